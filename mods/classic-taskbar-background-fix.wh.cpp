@@ -2,11 +2,11 @@
 // @id              classic-taskbar-background-fix
 // @name            Classic Taskbar background fix
 // @description     Fixes Taskbar background in classic theme by replacing black background with a classic button face colour
-// @version         1.0.3
+// @version         1.1.0
 // @author          Roland Pihlakas
 // @github          https://github.com/levitation
 // @homepage        https://www.simplify.ee/
-// @compilerOptions -luser32 -lgdi32 -luxtheme
+// @compilerOptions -luser32 -lgdi32 -luxtheme -lcomctl32
 // @include         explorer.exe
 // ==/WindhawkMod==
 
@@ -47,6 +47,9 @@ After:
 If you use 'Classic Taskbar 3D buttons Lite' and you have issues with vertical black lines around buttons then go to the settings of the current Taskbar background mod and under "Compatibility with classic Taskbar buttons mods" choose "Enhance compatibility with 'Classic Taskbar 3D buttons Lite'". Usually the presence of 'Classic Taskbar 3D buttons Lite' should be detected automatically, but if there will be forks which still have the same increased button spacing behaviour, but a different mod id, then you may need to set this setting manually.
 
 
+If you still see dark lines around buttons which are not pure black, for example 25-25-25, then you can add these colours under "Additional colour replacement rules". Note that these rules apply to all pixels in the repainted taskbar areas, including icons, so prefer small tolerances.
+
+
 ## Acknowledgements
 I would like to thank @Anixx and @OrthodoxWindows for testing the mod during its development and illustrating the issues found.
 */
@@ -67,18 +70,82 @@ I would like to thank @Anixx and @OrthodoxWindows for testing the mod during its
   - auto-detect: Auto detect
   - classic-taskbar-buttons-lite: Enhance compatibility with 'Classic Taskbar 3D buttons Lite'
   - no: No compatibility adjustments needed
+- BackBufferCacheBudget: 64
+  $name: Memory budget for cached paint buffers, in megabytes
+  $description: Paint buffers are kept per taskbar window in order to avoid allocating them during each repaint. If the budget is exceeded, the window is painted without the background fix until some buffers are released. Set to 0 in order to disable the budget limit.
+- BackgroundFixMethod:
+  - TaskList: auto
+    $name: Taskbar buttons area
+    $options:
+    - auto: Automatic
+    - floodFill: Flood fill
+    - replaceAll: Replace all black pixels
+    - colorKey: Replace all black pixels, using GDI colour keying
+  - Start: auto
+    $name: Start button
+    $options:
+    - auto: Automatic
+    - floodFill: Flood fill
+    - replaceAll: Replace all black pixels
+    - colorKey: Replace all black pixels, using GDI colour keying
+  - Taskbar: auto
+    $name: Primary and secondary taskbar windows
+    $options:
+    - auto: Automatic
+    - floodFill: Flood fill
+    - replaceAll: Replace all black pixels
+    - colorKey: Replace all black pixels, using GDI colour keying
+  $name: Background fix method
+  $description: Automatic flood fills starting from each gap between the buttons if the button layout is known, otherwise starting from the corner of the repainted area. Flood fill replaces only the black background connected to the corner, so black pixels inside icons are kept. The replace all methods replace also the black pixels inside icons, but do not depend on the background being connected. The colour keying variant lets GDI do the work, which may be faster on large taskbars.
+- ColorMappingRules:
+  - - Color: ""
+      $name: Colour to replace, in RRGGBB hexadecimal format
+      $description: For example 191919. Leave empty to disable the rule.
+    - Tolerance: 0
+      $name: Allowed difference per colour channel, 0 - 255
+    - ReplacementColor: buttonFace
+      $name: Replacement colour
+      $options:
+      - buttonFace: Button face colour
+      - buttonShadow: Button shadow colour
+      - buttonHighlight: Button highlight colour
+      - highlight: Selection highlight colour
+  $name: Additional colour replacement rules
+  $description: Applied to all pixels of the repainted taskbar areas after the background fix, up to 8 rules. The first matching rule is used. Useful for dark lines which are not pure black and therefore are not handled by the background fix.
+- ReuseUnchangedPaints: false
+  $name: Reuse the results for unchanged repaints
+  $description: Remembers the original and the fixed pixels of the most recent repaint per window. If the same area is painted again with exactly the same content and the same button layout, the remembered result is copied instead of fixing the area again. Applies only to the flood fill and automatic methods, since the other methods are cheaper to run again. Uses up to 2 megabytes of memory per taskbar window.
+- PaintCaptureFile: ""
+  $name: Paint capture file path, for diagnostics
+  $description: If not empty, the repainted taskbar areas are recorded to this file before and after the background fix. The file is overwritten when the mod is loaded or the path is changed. Changing the other settings continues the ongoing capture. Leave empty during normal use.
+- PaintCaptureMaxSize: 64
+  $name: Paint capture file size, in megabytes
+  $description: The file is allocated in full when the capture starts. The capture stops when the file is full.
+- ParallelPixelProcessing: false
+  $name: Use multiple threads for very large repaints
+  $description: Splits the colour replacement of repainted areas larger than about one million pixels, for example on 8K or spanned taskbars, into stripes processed in parallel. The flood fill used by default for the background fix remains single-threaded.
+- PaintStatistics: false
+  $name: Collect paint statistics, for diagnostics
+  $description: Collects the time spent in the mod's hooks and the amount of processed pixels into a shared memory block named "Local\classic-taskbar-background-fix-statistics-<explorer process id>", which can be read by external tools while explorer is running.
 */
 // ==/WindhawkModSettings==
 
 
 #include <windowsx.h>
+#include <commctrl.h>
 #include <winnt.h>      //defines HRESULT, needed for Visual Studio intellisense only, in clang the HRESULT seems to be defined already elsewhere, but the include does not harm either
 //#include <uxtheme.h>    //currently not needed since we use our own declaration of DrawThemeParentBackground and DrawThemeParentBackgroundEx
 #include <intrin.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <new>          //std::nothrow
+#include <vector>
 
 
 #ifndef WH_MOD
@@ -106,6 +173,18 @@ BOOL Wh_SetFunctionHookT(
 #endif
 
 
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define PIXEL_KERNELS_X86
+#endif
+
+//clang needs the instruction set to be enabled per function in order to compile the SIMD intrinsics without enabling them for the whole mod. Visual Studio does not need that.
+#if defined(__clang__) || defined(__GNUC__)
+#define TARGET_ATTRIBUTE(instructionSet)    __attribute__((target(instructionSet)))
+#else
+#define TARGET_ATTRIBUTE(instructionSet)
+#endif
+
+
 enum class RepaintDesktopButtonConfig {
     yes,
     highlightOnHover,
@@ -119,35 +198,331 @@ enum class CompatWithTaskbarButtonsModsConfig {
     no
 };
 
+enum class BackgroundFixMethod {
+    automatic,
+    floodFill,
+    replaceAll,
+    colorKey
+};
+
+enum class TaskbarWindowClass {
+    other,
+    shellTrayWnd,
+    start,
+    shellSecondaryTrayWnd,
+    taskList,
+    languageBar,
+    trayNotifyWnd,
+    button,
+    sysPager,
+    trayClock,
+    trayButton,
+    showDesktopButton
+};
+
+typedef struct tagTaskbarWindowClassName {
+    PCWSTR className;
+    TaskbarWindowClass windowClass;
+} TaskbarWindowClassName;
+
+const TaskbarWindowClassName taskbarWindowClassNames[] = {
+    { L"Shell_TrayWnd", TaskbarWindowClass::shellTrayWnd },
+    { L"Start", TaskbarWindowClass::start },
+    { L"Shell_SecondaryTrayWnd", TaskbarWindowClass::shellSecondaryTrayWnd },
+    { L"MSTaskListWClass", TaskbarWindowClass::taskList },
+    { L"CiceroUIWndFrame", TaskbarWindowClass::languageBar },
+    { L"TrayNotifyWnd", TaskbarWindowClass::trayNotifyWnd },
+    { L"Button", TaskbarWindowClass::button },
+    { L"SysPager", TaskbarWindowClass::sysPager },
+    { L"TrayClockWClass", TaskbarWindowClass::trayClock },
+    { L"TrayButton", TaskbarWindowClass::trayButton },
+    { L"TrayShowDesktopButtonWClass", TaskbarWindowClass::showDesktopButton },
+};
+
 
 const int nMaxDllPathLength = (MAX_PATH * 16);  //there is no function for retrieving the module name length, so need to use custom limit
 
 const COLORREF black = RGB(0, 0, 0);
 const int blackColorIndex = -1;    //mod's internal code for black colour
 
+const size_t maxColorMappingRules = 8;
+
 bool g_retryInitInAThread = false;
 HANDLE g_initThread = NULL;
 HANDLE g_initThreadStopSignal = NULL;
 HWND g_hwndTaskbar = NULL;
 
-std::mutex g_classicTaskbarButtonsLiteModDetectionMutex;
-std::map<void*, bool> g_classicTaskbarButtonsLiteModDetectionMap;
+std::mutex g_showDesktopButtonSubclassesMutex;
+std::vector<HWND> g_showDesktopButtonSubclasses;
+bool g_showDesktopButtonSubclassingDisabled = false;      //set during the mod unload, protected by g_showDesktopButtonSubclassesMutex
+std::atomic<HWND> g_hoveredShowDesktopButton;      //at most one button can be under the mouse at a time
+UINT g_unsubclassShowDesktopButtonMessage = 0;
+
+//TaskbarWindowClass per window class atom. Each slot packs the atom, the window class and a valid flag into one atomic value, so that the lookups in the paint hooks do not need a lock. Contains also the classes not relevant for the mod, so that their names are not looked up again. Colliding atoms just overwrite each other.
+const size_t windowClassAtomMapSize = 256;     //must be a power of two. Explorer has a limited number of window classes and their atoms are mostly consecutive, so the atom itself is used as the slot index.
+const uint64_t windowClassAtomMapValidFlag = 1;
+const int windowClassAtomMapClassShift = 1;
+const int windowClassAtomMapAtomShift = 16;
+
+std::atomic<uint64_t> g_windowClassAtomMap[windowClassAtomMapSize];
+
+//DLL notification declarations from ntdll, not available in the SDK headers
+typedef struct tagLdrDllNotificationData {
+    ULONG flags;
+    const void* fullDllName;     //PCUNICODE_STRING
+    const void* baseDllName;     //PCUNICODE_STRING
+    PVOID dllBase;
+    ULONG sizeOfImage;
+} LdrDllNotificationData;     //the same layout is used for both load and unload notifications
+
+typedef VOID (CALLBACK* LdrDllNotificationFunction_t)(ULONG notificationReason, const LdrDllNotificationData* notificationData, PVOID context);
+typedef LONG (NTAPI* LdrRegisterDllNotification_t)(ULONG flags, LdrDllNotificationFunction_t notificationFunction, PVOID context, PVOID* cookie);
+typedef LONG (NTAPI* LdrUnregisterDllNotification_t)(PVOID cookie);
+
+const ULONG ldrDllNotificationReasonUnloaded = 2;
+
+//Caller detection results per return address. Each slot packs the return address, the detection result and a valid flag into one atomic value, so that the lookups and the eviction on DLL unload do not need a lock. Colliding addresses just overwrite each other.
+const size_t callerDetectionCacheSize = 64;     //must be a power of two
+const uint64_t callerDetectionValidFlag = 1;
+const uint64_t callerDetectionResultFlag = 2;
+const int callerDetectionAddressShift = 2;      //user mode addresses fit into 62 bits
+
+std::atomic<uint64_t> g_callerDetectionCache[callerDetectionCacheSize];
+std::atomic<uint64_t> g_callerDetectionUnloadGeneration;    //incremented on each DLL unload, so that a detection which raced with the unload is not cached
+PVOID g_dllNotificationCookie = NULL;
+LdrUnregisterDllNotification_t pLdrUnregisterDllNotification = NULL;
 HMODULE hUxtheme = NULL;
 
 
+//32bpp top-down pixel buffer. Does not depend on GDI, the pixels may come from a DIB section or from any other memory.
+typedef struct tagPixelSurface {
+    uint32_t* pixels;
+    int width;
+    int height;
+    ptrdiff_t stride;   //in pixels
+} PixelSurface;
+
+//A horisontal run of pixels
+struct PixelRun {
+    int y;
+    int x;
+    int length;
+};
+
+typedef struct tagPooledMemDC {
+    HDC memDC;
+    HBITMAP memBitmap;      //a top-down 32bpp DIB section
+    HGDIOBJ oldBitmap;
+    uint32_t* pixels;       //direct access to the DIB section pixels. Call GdiFlush() before accessing the pixels after GDI drawing.
+    int width;
+    int height;
+    size_t bytes;
+    DWORD lastThreadId;
+    uint64_t displaySignature;
+} PooledMemDC;
+
+const size_t maxRecordedFrameControlRects = 64;     //if there are more buttons than that, fall back to flood fill
+
+//Stored inline in thread local storage, so it must remain trivially destructible
 typedef struct tagMemDCInfo {
     HDC originalHdc;
-    HBITMAP memBitmap;
-    HGDIOBJ oldBitmap;
+    HWND hWnd;
+    PooledMemDC* backBuffer;
     int colorIndex;
+    BackgroundFixMethod backgroundFixMethod;
+    RECT frameControlRects[maxRecordedFrameControlRects];    //button background rects filled by DrawFrameControlHook during the paint, in back buffer coordinates
+    size_t frameControlRectCount;
+    bool frameControlRectsOverflow;
 } MemDCInfo;
 
+typedef struct tagBackBufferCacheEntry {
+    PooledMemDC* backBuffer;
+    bool inUse;
+} BackBufferCacheEntry;
+
+
+const int memDCPoolBucketGranularity = 32;     //in pixels, both for width and height
+const size_t memDCPoolMaxIdleEntries = 16;
+const size_t memDCPoolMaxIdleBytes = 64 * 1024 * 1024;
+
+std::mutex g_memDCPoolMutex;
+std::multimap<uint64_t, PooledMemDC*> g_memDCPool;     //idle entries by size bucket. Using multimap since there may be multiple entries with same size bucket, for example when multiple taskbar threads paint in parallel
+uint64_t g_memDCPoolDisplaySignature = 0;
+size_t g_memDCPoolIdleBytes = 0;
+size_t g_memDCPoolTotalBytes = 0;      //both idle entries and entries in use
+size_t g_memDCPoolTotalBytesHighWaterMark = 0;
+size_t g_memDCPoolAcquireCount = 0;
+size_t g_memDCPoolHitCount = 0;
+
+const ULONGLONG backBufferCacheSweepInterval = 1000;    //in milliseconds. The back buffers of destroyed windows are released during the next acquisition or release after that.
+
+std::mutex g_backBufferCacheMutex;
+std::map<HWND, BackBufferCacheEntry> g_backBufferCache;
+size_t g_backBufferCacheBudget = 0;     //in bytes, 0 means no limit
+size_t g_backBufferCacheBytes = 0;
+ULONGLONG g_backBufferCacheLastSweepTime = 0;
+size_t g_backBufferCacheHitCount = 0;
+size_t g_backBufferCacheMissCount = 0;
+size_t g_backBufferCacheOverBudgetCount = 0;
+
+
+typedef struct tagBackgroundMaskCacheEntry {
+    std::shared_ptr<const std::vector<PixelRun>> runs;     //shared so that the mask can be applied without holding the cache lock
+    uint64_t lastUse;
+} BackgroundMaskCacheEntry;
+
+const size_t backgroundMaskCacheMaxEntries = 64;
+const size_t backgroundMaskMaxRuns = 4096;     //larger masks are not cached
+const int backgroundMaskSampleStep = 8;     //every n-th pixel of the runs and of their vertical border is validated on a cache hit
+
+std::mutex g_backgroundMaskCacheMutex;
+std::map<uint64_t, BackgroundMaskCacheEntry> g_backgroundMaskCache;
+uint64_t g_backgroundMaskCacheDisplaySignature = 0;
+uint64_t g_backgroundMaskCacheUseCounter = 0;
+size_t g_backgroundMaskCacheLookupCount = 0;
+std::atomic<size_t> g_backgroundMaskCacheHitCount;
+std::atomic<size_t> g_backgroundMaskCacheMismatchCount;     //a cached mask was found, but the painted content did not match it anymore
+
+
+//The most recent paint of each window is remembered together with everything that its fix result depends on. The content is compared pixel by pixel, so that a changed paint is never mistaken for the remembered one.
+const size_t paintReuseCacheMaxWindows = 16;
+const size_t paintReuseCacheMaxPixelsPerWindow = 256 * 1024;     //larger paints are not remembered. Both the original and the fixed pixels are kept.
+
+typedef struct tagPaintReuseCacheEntry {
+    int surfaceWidth;
+    int surfaceHeight;
+    uint64_t fixSignature;      //the result is valid only for the same colours, method and rules
+    RECT paintRect;             //the flood fill seeds and bounds depend on the paint rect
+    std::vector<RECT> frameControlRects;    //the automatic method fills around the frame control rects recorded during the paint
+    bool frameControlRectsOverflow;
+    std::vector<uint32_t> originalPixels;   //the paint rect clipped to the back buffer, before the background fix
+    std::vector<uint32_t> fixedPixels;      //the same area after the background fix and the colour mapping rules
+    uint64_t lastUse;
+} PaintReuseCacheEntry;
+
+std::atomic<bool> g_paintReuseEnabled;
+std::mutex g_paintReuseCacheMutex;
+std::map<HWND, PaintReuseCacheEntry*> g_paintReuseCache;      //a window's entry is removed from the map during its paint, so that the entry can be used without holding the lock
+uint64_t g_paintReuseCacheUseCounter = 0;
+
+
+//Paint capture file layout: PaintCaptureFileHeader, followed by records. Each record is a PaintCaptureRecordHeader, followed by the run length encoded pixels of the captured area before the fix and after the fix. The pixels are in DIB format and are encoded as pairs of uint32_t values: run length and pixel.
+const uint32_t paintCaptureFileMagic = 0x50415443;      //"CTAP" when read as bytes
+const uint32_t paintCaptureFileVersion = 1;
+
+typedef struct tagPaintCaptureFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fileSize;
+    uint64_t dataSize;      //including this header, up to the end of the last complete record
+    uint64_t recordCount;
+} PaintCaptureFileHeader;
+
+typedef struct tagPaintCaptureRecordHeader {
+    uint32_t recordSize;        //including this header
+    int32_t colorIndex;
+    uint64_t tickCount;
+    WCHAR className[64];
+    RECT paintRect;             //rcPaint as given by BeginPaint
+    int32_t width;              //the captured area is rcPaint clipped to the back buffer
+    int32_t height;
+    uint32_t beforeRunCount;
+    uint32_t afterRunCount;
+} PaintCaptureRecordHeader;
+
+std::mutex g_paintCaptureMutex;
+HANDLE g_paintCaptureFile = INVALID_HANDLE_VALUE;
+HANDLE g_paintCaptureFileMapping = NULL;
+BYTE* g_paintCaptureView = NULL;
+bool g_paintCaptureFileFullLogged = false;
+WCHAR g_paintCaptureFilePath[MAX_PATH] = L"";     //of the currently open capture file, so that a settings change does not restart an ongoing capture
+
+
+//Paint statistics shared memory layout: PaintStatistics. The values are updated with atomic operations and can be read by other processes at any time. The latency histogram bucket 0 counts calls shorter than 1 microsecond, and bucket i counts calls taking [2^(i-1), 2^i) microseconds, the last bucket counts also all longer calls.
+const uint32_t paintStatisticsMagic = 0x53544243;      //"CBTS" when read as bytes
+const uint32_t paintStatisticsVersion = 3;
+const int latencyHistogramBucketCount = 32;
+
+enum class HookTimingId {
+    beginPaint,
+    endPaint,
+    drawFrameControl,
+    drawThemeParentBackground,
+    count
+};
 
-std::mutex g_hdcMapMutex;
-std::map<HDC, MemDCInfo> g_hdcMap;      //using map not unordered_map since the latter becomes slow when doing many insertions and removals. Also it is expected that the current map will contain only a few elements at a time
+typedef struct tagHookTimingStatistics {
+    std::atomic<uint64_t> callCount;
+    std::atomic<uint64_t> totalMicroseconds;
+    std::atomic<uint64_t> latencyHistogram[latencyHistogramBucketCount];
+} HookTimingStatistics;
+
+typedef struct tagPaintStatistics {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          //size of this structure
+    uint32_t hookCount;
+    HookTimingStatistics hooks[(int)HookTimingId::count];      //the time spent in the mod's code in each hook, excluding the original functions
+    std::atomic<uint64_t> pixelsProcessed;      //pixels of the repainted areas which went through the background fix
+    std::atomic<uint64_t> fillsSkipped;         //fills which found no background colour pixels to replace
+    std::atomic<uint64_t> allocatedBytes;       //bytes of the paint buffers allocated
+    std::atomic<uint64_t> paintsReused;         //paints whose remembered fix result was copied instead of fixing them
+    std::atomic<uint64_t> paintsNotReused;      //paints fixed while the paint reuse was enabled
+} PaintStatistics;
+
+HANDLE g_paintStatisticsMapping = NULL;
+PaintStatistics* g_paintStatisticsView = NULL;
+std::atomic<PaintStatistics*> g_paintStatistics;    //NULL when the statistics collection is disabled. The view itself is kept until uninit since the hooks may be using it.
+LONGLONG g_performanceFrequency = 0;
+
+
+typedef void (*SurfaceStripeFunction_t)(const PixelSurface& stripe, void* context);
+
+const size_t maxPixelWorkerThreads = 7;
+const size_t parallelPixelProcessingMinPixels = 1024 * 1024;     //smaller surfaces are processed faster on the calling thread than the workers could be woken up
+
+std::atomic<bool> g_parallelPixelProcessingEnabled;
+std::mutex g_pixelWorkerJobMutex;       //only one job runs at a time. Callers which find the pool busy process their surface on their own thread.
+
+std::mutex g_pixelWorkerPoolMutex;      //protects the worker pool state below
+std::condition_variable g_pixelWorkerPoolWakeup;
+std::condition_variable g_pixelWorkerPoolJobDone;
+HANDLE g_pixelWorkerThreads[maxPixelWorkerThreads];
+size_t g_pixelWorkerThreadCount = 0;
+bool g_pixelWorkerPoolStop = false;
+PixelSurface g_pixelWorkerJobSurface;
+SurfaceStripeFunction_t g_pixelWorkerJobFunction = NULL;
+void* g_pixelWorkerJobContext = NULL;
+size_t g_pixelWorkerJobStripeCount = 0;
+size_t g_pixelWorkerJobNextStripe = 0;
+size_t g_pixelWorkerJobStripesRemaining = 0;
+
+
+//The in-flight paints of the current thread, the most recent last. BeginPaint and EndPaint are always called on the thread of the window, so no locking is needed. Usually there is only one paint in flight, but a window may paint another window synchronously during its own paint.
+//Only trivially destructible thread locals are used, so that the mod DLL does not register TLS destructors which could run after the mod is unloaded.
+//The records are allocated once per thread, on the first paint of a taskbar window, so that the many explorer threads which never paint the taskbar do not pay for them. The allocations are freed when the mod is unloaded.
+const size_t maxPaintsInFlightPerThread = 4;
+thread_local MemDCInfo* t_paintsInFlight = NULL;
+thread_local size_t t_paintsInFlightCount = 0;
+
+std::mutex g_paintsInFlightAllocationsMutex;
+std::vector<MemDCInfo*> g_paintsInFlightAllocations;
 
 RepaintDesktopButtonConfig g_repaintDesktopButtonConfig;
 CompatWithTaskbarButtonsModsConfig g_compatWithTaskbarButtonsModsConfig;
+BackgroundFixMethod g_taskListBackgroundFixMethod;
+BackgroundFixMethod g_startBackgroundFixMethod;
+BackgroundFixMethod g_taskbarBackgroundFixMethod;
+
+typedef struct tagColorMappingRuleConfig {
+    uint32_t pixel;
+    uint32_t tolerance;
+    int colorIndex;
+} ColorMappingRuleConfig;
+
+std::mutex g_colorMappingRulesMutex;
+ColorMappingRuleConfig g_colorMappingRules[maxColorMappingRules];
+size_t g_colorMappingRuleCount = 0;
 
 
 using BeginPaint_t = decltype(&BeginPaint);
@@ -178,6 +553,36 @@ RepaintDesktopButtonConfig DesktopButtonConfigFromString(PCWSTR string) {
     }
 }
 
+int ReplacementColorIndexFromString(PCWSTR string) {
+    if (wcscmp(string, L"buttonShadow") == 0) {
+        return COLOR_3DSHADOW;
+    }
+    else if (wcscmp(string, L"buttonHighlight") == 0) {
+        return COLOR_3DHIGHLIGHT;
+    }
+    else if (wcscmp(string, L"highlight") == 0) {
+        return COLOR_HIGHLIGHT;
+    }
+    else {
+        return COLOR_3DFACE;
+    }
+}
+
+BackgroundFixMethod BackgroundFixMethodFromString(PCWSTR string) {
+    if (wcscmp(string, L"floodFill") == 0) {
+        return BackgroundFixMethod::floodFill;
+    }
+    else if (wcscmp(string, L"replaceAll") == 0) {
+        return BackgroundFixMethod::replaceAll;
+    }
+    else if (wcscmp(string, L"colorKey") == 0) {
+        return BackgroundFixMethod::colorKey;
+    }
+    else {
+        return BackgroundFixMethod::automatic;
+    }
+}
+
 CompatWithTaskbarButtonsModsConfig CompatWithTaskbarButtonsModsConfigFromString(PCWSTR string) {
     if (wcscmp(string, L"no") == 0) {
         return CompatWithTaskbarButtonsModsConfig::no;
@@ -246,6 +651,66 @@ PCWSTR GetModuleName(
     }
 }
 
+size_t GetCallerDetectionCacheSlot(void* returnAddress) {
+    return (size_t)(((uint64_t)(uintptr_t)returnAddress * 0x9E3779B97F4A7C15ull) >> 32) & (callerDetectionCacheSize - 1);
+}
+
+uint64_t PackCallerDetectionCacheEntry(void* returnAddress, bool callerIsClassicTaskbarButtonsLiteMod) {
+    return ((uint64_t)(uintptr_t)returnAddress << callerDetectionAddressShift)
+        | (callerIsClassicTaskbarButtonsLiteMod ? callerDetectionResultFlag : 0)
+        | callerDetectionValidFlag;
+}
+
+//Called by the loader, under the loader lock, so must not do anything except clearing the cache entries
+VOID CALLBACK DllNotificationCallback(ULONG notificationReason, const LdrDllNotificationData* notificationData, PVOID context) {
+
+    if (notificationReason != ldrDllNotificationReasonUnloaded || !notificationData)
+        return;
+
+    g_callerDetectionUnloadGeneration++;
+
+    uintptr_t dllStart = (uintptr_t)notificationData->dllBase;
+    uintptr_t dllEnd = dllStart + notificationData->sizeOfImage;
+
+    for (std::atomic<uint64_t>& slot : g_callerDetectionCache) {
+
+        uint64_t entry = slot.load();
+        uintptr_t address = (uintptr_t)(entry >> callerDetectionAddressShift);
+
+        if ((entry & callerDetectionValidFlag) && address >= dllStart && address < dllEnd)
+            slot.compare_exchange_strong(entry, 0);     //if the slot was concurrently overwritten with another address, then leave it as is
+    }
+}
+
+void RegisterDllNotification() {
+
+    HMODULE hNtdll = GetModuleHandleW(L"ntdll.dll");
+    if (!hNtdll) {
+        Wh_Log(L"Finding ntdll.dll failed");
+        return;
+    }
+
+    LdrRegisterDllNotification_t pLdrRegisterDllNotification = (LdrRegisterDllNotification_t)GetProcAddress(hNtdll, "LdrRegisterDllNotification");
+    pLdrUnregisterDllNotification = (LdrUnregisterDllNotification_t)GetProcAddress(hNtdll, "LdrUnregisterDllNotification");
+    if (!pLdrRegisterDllNotification || !pLdrUnregisterDllNotification) {
+        Wh_Log(L"Finding DLL notification functions failed");
+        return;
+    }
+
+    if (pLdrRegisterDllNotification(0, DllNotificationCallback, NULL, &g_dllNotificationCookie) != 0) {   //STATUS_SUCCESS
+        Wh_Log(L"LdrRegisterDllNotification failed, the caller detection cache will not be cleared on DLL unload");
+        g_dllNotificationCookie = NULL;
+    }
+}
+
+void UnregisterDllNotification() {
+
+    if (g_dllNotificationCookie) {
+        pLdrUnregisterDllNotification(g_dllNotificationCookie);
+        g_dllNotificationCookie = NULL;
+    }
+}
+
 bool IsCallerClassicTaskbarButtonsLiteMod(void* returnAddress) {
 
     bool callerIsClassicTaskbarButtonsLiteMod = false;
@@ -259,12 +724,18 @@ bool IsCallerClassicTaskbarButtonsLiteMod(void* returnAddress) {
         g_compatWithTaskbarButtonsModsConfig 
         == CompatWithTaskbarButtonsModsConfig::autoDetect
     ) {
-        std::lock_guard<std::mutex> guard(g_classicTaskbarButtonsLiteModDetectionMutex);
-        auto it = g_classicTaskbarButtonsLiteModDetectionMap.find(returnAddress);
-        if (it != g_classicTaskbarButtonsLiteModDetectionMap.end()) {
-            callerIsClassicTaskbarButtonsLiteMod = it->second;
+        std::atomic<uint64_t>& slot = g_callerDetectionCache[GetCallerDetectionCacheSlot(returnAddress)];
+        uint64_t entry = slot.load();
+
+        if (entry == PackCallerDetectionCacheEntry(returnAddress, false)) {
+            callerIsClassicTaskbarButtonsLiteMod = false;
+        }
+        else if (entry == PackCallerDetectionCacheEntry(returnAddress, true)) {
+            callerIsClassicTaskbarButtonsLiteMod = true;
         }
         else {
+            uint64_t unloadGeneration = g_callerDetectionUnloadGeneration.load();
+
             HMODULE callerModule = GetCallerModule(returnAddress);
 
             WCHAR stackBuffer[nMaxDllPathLength];
@@ -289,214 +760,2191 @@ bool IsCallerClassicTaskbarButtonsLiteMod(void* returnAddress) {
                 Wh_Log(L"A non classic-taskbar-buttons-lite mod detected");
             }
 
-            //Saving to a map enables handling cases where the user changes the active buttons mod. Also there may be different callers to this hooked function. We need to have special handling only if the caller is classic-taskbar-buttons-lite mod, otherwise no special handling is needed.
-            //We could use DllMain() to remove obsolete entries from g_classicTaskbarButtonsLiteModDetectionMap, but it is expected to happen rarely that a dll (or mod) using the DrawFrameControl() function is unloaded, so lets not bother with that.
-            g_classicTaskbarButtonsLiteModDetectionMap.insert({ 
-                returnAddress, 
-                callerIsClassicTaskbarButtonsLiteMod 
-            });
+            //Caching per return address enables handling cases where the user changes the active buttons mod. Also there may be different callers to this hooked function. We need to have special handling only if the caller is classic-taskbar-buttons-lite mod, otherwise no special handling is needed.
+            //The entries of unloaded DLLs are removed by DllNotificationCallback, since another DLL may be loaded at the same address later.
+            uint64_t newEntry = PackCallerDetectionCacheEntry(returnAddress, callerIsClassicTaskbarButtonsLiteMod);
+            slot.store(newEntry);
+
+            if (g_callerDetectionUnloadGeneration.load() != unloadGeneration)    //a DLL was unloaded during the detection, the result may be about the unloaded DLL
+                slot.compare_exchange_strong(newEntry, 0);
+        }
+    }
+
+    return callerIsClassicTaskbarButtonsLiteMod;
+}
+
+
+TaskbarWindowClass TaskbarWindowClassFromName(PCWSTR className) {
+
+    for (const TaskbarWindowClassName& item : taskbarWindowClassNames) {
+        if (_wcsicmp(className, item.className) == 0)
+            return item.windowClass;
+    }
+    return TaskbarWindowClass::other;
+}
+
+//The window class atoms are resolved to TaskbarWindowClass on first sight, so that the class name needs to be retrieved and compared only once per class, not during each paint.
+//Returns false if the window class could not be determined.
+bool GetTaskbarWindowClass(OUT TaskbarWindowClass* windowClass, HWND hWnd) {
+
+    ATOM atom = (ATOM)GetClassWord(hWnd, GCW_ATOM);
+    if (atom) {
+        uint64_t entry = g_windowClassAtomMap[atom & (windowClassAtomMapSize - 1)].load(std::memory_order_relaxed);
+        if (
+            (entry & windowClassAtomMapValidFlag)
+            && (ATOM)(entry >> windowClassAtomMapAtomShift) == atom
+        ) {
+            *windowClass = (TaskbarWindowClass)((entry & ((1 << windowClassAtomMapAtomShift) - 1)) >> windowClassAtomMapClassShift);
+            return true;
+        }
+    }
+
+    WCHAR szClassName[32];
+    if (!GetClassNameW(hWnd, szClassName, ARRAYSIZE(szClassName)))
+        return false;
+
+    *windowClass = TaskbarWindowClassFromName(szClassName);
+
+    if (atom) {
+        g_windowClassAtomMap[atom & (windowClassAtomMapSize - 1)].store(
+            ((uint64_t)atom << windowClassAtomMapAtomShift)
+            | ((uint64_t)*windowClass << windowClassAtomMapClassShift)
+            | windowClassAtomMapValidFlag,
+            std::memory_order_relaxed
+        );
+    }
+
+    return true;
+}
+
+//A class atom may be reused by another class after the original class is unregistered, so the map is cleared whenever the taskbar is (re)initialised and when the settings change
+void FlushWindowClassAtomMap() {
+
+    for (std::atomic<uint64_t>& slot : g_windowClassAtomMap)
+        slot.store(0);
+}
+
+//Returns the background fix method for the windows repainted by BeginPaintHook and EndPaintHook
+BackgroundFixMethod GetBackgroundFixMethod(HWND hWnd) {
+
+    TaskbarWindowClass windowClass;
+    if (!GetTaskbarWindowClass(&windowClass, hWnd))
+        return BackgroundFixMethod::automatic;
+    else if (windowClass == TaskbarWindowClass::taskList)
+        return g_taskListBackgroundFixMethod;
+    else if (windowClass == TaskbarWindowClass::start)
+        return g_startBackgroundFixMethod;
+    else if (
+        windowClass == TaskbarWindowClass::shellTrayWnd
+        || windowClass == TaskbarWindowClass::shellSecondaryTrayWnd
+    )
+        return g_taskbarBackgroundFixMethod;
+    else
+        return BackgroundFixMethod::automatic;
+}
+
+bool IsShowDesktopButtonHoverConfig() {
+    return g_repaintDesktopButtonConfig == RepaintDesktopButtonConfig::highlightOnHover
+        || g_repaintDesktopButtonConfig == RepaintDesktopButtonConfig::blackOnHover;
+}
+
+LRESULT CALLBACK ShowDesktopButtonSubclassProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam, UINT_PTR uIdSubclass, DWORD_PTR dwRefData) {
+
+    if (uMsg == WM_MOUSEMOVE) {
+
+        if (g_hoveredShowDesktopButton.load() != hWnd) {
+
+            //request WM_MOUSELEAVE
+            TRACKMOUSEEVENT trackMouseEvent = {};
+            trackMouseEvent.cbSize = sizeof(trackMouseEvent);
+            trackMouseEvent.dwFlags = TME_LEAVE;
+            trackMouseEvent.hwndTrack = hWnd;
+            if (!TrackMouseEvent(&trackMouseEvent))
+                Wh_Log(L"TrackMouseEvent failed");
+
+            g_hoveredShowDesktopButton.store(hWnd);
+            if (IsShowDesktopButtonHoverConfig())
+                RedrawWindow(hWnd, NULL, NULL, RDW_INVALIDATE);
+        }
+    }
+    else if (uMsg == WM_MOUSELEAVE) {
+
+        HWND expectedHwnd = hWnd;
+        if (g_hoveredShowDesktopButton.compare_exchange_strong(expectedHwnd, NULL)) {
+            if (IsShowDesktopButtonHoverConfig())
+                RedrawWindow(hWnd, NULL, NULL, RDW_INVALIDATE);
+        }
+    }
+    else if (
+        uMsg == WM_NCDESTROY
+        || (uMsg == g_unsubclassShowDesktopButtonMessage && g_unsubclassShowDesktopButtonMessage)
+    ) {
+        HWND expectedHwnd = hWnd;
+        g_hoveredShowDesktopButton.compare_exchange_strong(expectedHwnd, NULL);
+
+        RemoveWindowSubclass(hWnd, ShowDesktopButtonSubclassProc, 0);
+
+        {
+            std::lock_guard<std::mutex> guard(g_showDesktopButtonSubclassesMutex);
+            g_showDesktopButtonSubclasses.erase(
+                std::remove(g_showDesktopButtonSubclasses.begin(), g_showDesktopButtonSubclasses.end(), hWnd),
+                g_showDesktopButtonSubclasses.end()
+            );
+        }
+
+        if (uMsg != WM_NCDESTROY)
+            return 0;
+    }
+
+    return DefSubclassProc(hWnd, uMsg, wParam, lParam);
+}
+
+//The hover state is tracked by subclassing the button, which has to be done on the thread of the button. Returns false if the button is not subclassed, in which case the caller needs to check the cursor position instead.
+bool EnsureShowDesktopButtonSubclassed(HWND hWnd) {
+
+    DWORD_PTR refData;
+    if (GetWindowSubclass(hWnd, ShowDesktopButtonSubclassProc, 0, &refData))
+        return true;
+
+    if (
+        !g_unsubclassShowDesktopButtonMessage
+        || GetWindowThreadProcessId(hWnd, NULL) != GetCurrentThreadId()
+    ) {
+        return false;
+    }
+
+    //the lock is held while subclassing, so that the unload either sees the new subclass in the list or prevents it from being added
+    std::lock_guard<std::mutex> guard(g_showDesktopButtonSubclassesMutex);
+
+    if (g_showDesktopButtonSubclassingDisabled)
+        return false;
+
+    if (!SetWindowSubclass(hWnd, ShowDesktopButtonSubclassProc, 0, 0)) {
+        Wh_Log(L"SetWindowSubclass failed for show desktop button");
+        return false;
+    }
+
+    g_showDesktopButtonSubclasses.push_back(hWnd);
+    return true;
+}
+
+void UnsubclassShowDesktopButtons() {
+
+    std::vector<HWND> subclassedButtons;
+    {
+        std::lock_guard<std::mutex> guard(g_showDesktopButtonSubclassesMutex);
+        g_showDesktopButtonSubclassingDisabled = true;
+        subclassedButtons = g_showDesktopButtonSubclasses;
+    }
+
+    //The subclass can be removed only on the thread of the window. The call has to block until the subclass is removed, since the subclass procedure must not remain in the chain after the mod is unloaded. If the window has been destroyed meanwhile then the subclass was already removed during WM_NCDESTROY.
+    for (HWND hWnd : subclassedButtons)
+        SendMessageW(hWnd, g_unsubclassShowDesktopButtonMessage, 0, 0);
+}
+
+bool WindowNeedsBackgroundRepaint(OUT int* colorIndex, HWND hWnd, const RECT* paintRect, bool isDrawThemeParentBackgroundCall) {
+
+    TaskbarWindowClass windowClass;
+    if (
+        hWnd 
+        && GetTaskbarWindowClass(&windowClass, hWnd)
+    ) {
+        if (
+            isDrawThemeParentBackgroundCall
+            && (
+                g_repaintDesktopButtonConfig == RepaintDesktopButtonConfig::highlightOnHover
+                || g_repaintDesktopButtonConfig == RepaintDesktopButtonConfig::blackOnHover
+            )
+            && windowClass == TaskbarWindowClass::showDesktopButton
+        ) {
+            bool mouseIsOverShowDesktopButton = false;
+            bool isHoverStateKnown = false;
+
+            if (EnsureShowDesktopButtonSubclassed(hWnd)) {     //the subclass tracks the hover state and repaints the button when it changes
+
+                mouseIsOverShowDesktopButton = g_hoveredShowDesktopButton.load() == hWnd;
+                isHoverStateKnown = true;
+            }
+            else {  //fall back to checking the cursor position during each paint
+
+                POINT cursorPos;
+                if (GetCursorPos(&cursorPos)) {
+                    if (ScreenToClient(
+                        hWnd,
+                        &cursorPos
+                    )) {
+                        mouseIsOverShowDesktopButton = PtInRect(
+                            paintRect,
+                            cursorPos
+                        );
+                        isHoverStateKnown = true;
+                    }
+                }
+            }
+
+            if (isHoverStateKnown) {
+
+                if (mouseIsOverShowDesktopButton) {
+                    if (g_repaintDesktopButtonConfig == RepaintDesktopButtonConfig::highlightOnHover)
+                        *colorIndex = COLOR_HIGHLIGHT;
+                    else
+                        *colorIndex = blackColorIndex;
+                }
+                else {
+                    *colorIndex = COLOR_3DFACE;
+                }
+
+                return true;
+            }
+        }
+        else if (
+            isDrawThemeParentBackgroundCall        //painting the "show desktop" button black again since without it earlier calls to DrawThemeParentBackground would remove the black color from "show desktop" button as a side effect of painting other tray areas
+            && g_repaintDesktopButtonConfig == RepaintDesktopButtonConfig::no
+            && windowClass == TaskbarWindowClass::showDesktopButton   //show desktop button
+        ) {
+            *colorIndex = blackColorIndex;     
+            return true;
+        }
+        else {
+
+            bool result =
+                windowClass == TaskbarWindowClass::shellTrayWnd        //around of start button in case OpenShell is active
+                || windowClass == TaskbarWindowClass::start             //around of start button in case OpenShell is NOT active
+                || windowClass == TaskbarWindowClass::shellSecondaryTrayWnd        //secondary taskbar
+                || windowClass == TaskbarWindowClass::taskList      //around of taskbar buttons
+                || (
+                    isDrawThemeParentBackgroundCall
+                    && (
+                        windowClass == TaskbarWindowClass::languageBar     //language bar
+                        || windowClass == TaskbarWindowClass::trayNotifyWnd     //around of tray, sometimes may be a very thin line, but could be also a wider area
+                        || windowClass == TaskbarWindowClass::button        //three dots of the "show hidden icons" button
+                        || windowClass == TaskbarWindowClass::sysPager      //visible tray icons
+                        //ToolbarWindow32 class: Background of both visible and hidden tray icons. Not repainting it in order to not repaint hidden tray icons popup background. Not needed anyway, since painting SysPager class has already the desired effect.
+                        || windowClass == TaskbarWindowClass::trayClock       //clock
+                        || windowClass == TaskbarWindowClass::trayButton        //action center button
+                        || (
+                            g_repaintDesktopButtonConfig == RepaintDesktopButtonConfig::yes
+                            && windowClass == TaskbarWindowClass::showDesktopButton   //show desktop button
+                        )
+                    )
+                );
+
+            *colorIndex = COLOR_3DFACE;     //unused if result == false
+            return result;
+        }
+    }
+    
+    return false;
+}
+
+
+//Pixel kernels. These operate on plain 32bpp pixel buffers and do not call any Windows API-s, so they can be reused for any pixel source.
+//Note that the pixel values in 32bpp DIB-s are in 0x00RRGGBB format, while COLORREF is in 0x00BBGGRR format. Use ColorRefToDibPixel() for converting the colours. The alpha byte is ignored during comparisons since GDI does not maintain it consistently.
+
+const uint32_t dibPixelColorMask = 0x00FFFFFF;
+
+inline uint32_t ColorRefToDibPixel(COLORREF color) {
+    return (uint32_t)((GetRValue(color) << 16) | (GetGValue(color) << 8) | GetBValue(color));
+}
+
+typedef void (*ReplaceColorKernel_t)(uint32_t* pixels, size_t pixelCount, uint32_t oldPixel, uint32_t newPixel);
+typedef bool (*ContainsColorKernel_t)(const uint32_t* pixels, size_t pixelCount, uint32_t pixel);
+
+typedef struct tagColorMappingRule {
+    uint32_t pixel;
+    uint32_t tolerance;    //maximum difference per colour channel
+    uint32_t newPixel;
+} ColorMappingRule;
+
+//Applies all rules in one pass over the pixels. For each pixel, the first matching rule is used.
+typedef void (*ApplyColorRulesKernel_t)(uint32_t* pixels, size_t pixelCount, const ColorMappingRule* rules, size_t ruleCount);
+
+void ReplaceColorScalar(uint32_t* pixels, size_t pixelCount, uint32_t oldPixel, uint32_t newPixel) {
+
+    for (size_t i = 0; i < pixelCount; ++i) {
+        if ((pixels[i] & dibPixelColorMask) == oldPixel)
+            pixels[i] = newPixel;
+    }
+}
+
+bool ContainsColorScalar(const uint32_t* pixels, size_t pixelCount, uint32_t pixel) {
+
+    for (size_t i = 0; i < pixelCount; ++i) {
+        if ((pixels[i] & dibPixelColorMask) == pixel)
+            return true;
+    }
+    return false;
+}
+
+inline bool ColorChannelsWithinTolerance(uint32_t pixel1, uint32_t pixel2, uint32_t tolerance) {
+
+    for (int shift = 0; shift < 24; shift += 8) {
+        int channel1 = (pixel1 >> shift) & 0xFF;
+        int channel2 = (pixel2 >> shift) & 0xFF;
+        if ((uint32_t)abs(channel1 - channel2) > tolerance)
+            return false;
+    }
+    return true;
+}
+
+void ApplyColorRulesScalar(uint32_t* pixels, size_t pixelCount, const ColorMappingRule* rules, size_t ruleCount) {
+
+    for (size_t i = 0; i < pixelCount; ++i) {
+        uint32_t color = pixels[i] & dibPixelColorMask;
+        for (size_t ruleIndex = 0; ruleIndex < ruleCount; ruleIndex++) {
+            if (ColorChannelsWithinTolerance(color, rules[ruleIndex].pixel, rules[ruleIndex].tolerance)) {
+                pixels[i] = rules[ruleIndex].newPixel;
+                break;
+            }
+        }
+    }
+}
+
+#ifdef PIXEL_KERNELS_X86
+
+TARGET_ATTRIBUTE("sse2")
+void ReplaceColorSse2(uint32_t* pixels, size_t pixelCount, uint32_t oldPixel, uint32_t newPixel) {
+
+    const __m128i colorMask = _mm_set1_epi32(dibPixelColorMask);
+    const __m128i oldPixels = _mm_set1_epi32(oldPixel);
+    const __m128i newPixels = _mm_set1_epi32(newPixel);
+
+    size_t i = 0;
+    for (; i + 4 <= pixelCount; i += 4) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(pixels + i));
+        __m128i isOldColor = _mm_cmpeq_epi32(_mm_and_si128(block, colorMask), oldPixels);
+        block = _mm_or_si128(
+            _mm_and_si128(isOldColor, newPixels),
+            _mm_andnot_si128(isOldColor, block)
+        );
+        _mm_storeu_si128((__m128i*)(pixels + i), block);
+    }
+
+    ReplaceColorScalar(pixels + i, pixelCount - i, oldPixel, newPixel);     //remaining pixels
+}
+
+TARGET_ATTRIBUTE("avx2")
+void ReplaceColorAvx2(uint32_t* pixels, size_t pixelCount, uint32_t oldPixel, uint32_t newPixel) {
+
+    const __m256i colorMask = _mm256_set1_epi32(dibPixelColorMask);
+    const __m256i oldPixels = _mm256_set1_epi32(oldPixel);
+    const __m256i newPixels = _mm256_set1_epi32(newPixel);
+
+    size_t i = 0;
+    for (; i + 8 <= pixelCount; i += 8) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(pixels + i));
+        __m256i isOldColor = _mm256_cmpeq_epi32(_mm256_and_si256(block, colorMask), oldPixels);
+        block = _mm256_blendv_epi8(block, newPixels, isOldColor);
+        _mm256_storeu_si256((__m256i*)(pixels + i), block);
+    }
+
+    _mm256_zeroupper();     //avoid AVX-SSE transition penalties in the code that follows
+
+    ReplaceColorScalar(pixels + i, pixelCount - i, oldPixel, newPixel);     //remaining pixels
+}
+
+TARGET_ATTRIBUTE("sse2")
+bool ContainsColorSse2(const uint32_t* pixels, size_t pixelCount, uint32_t pixel) {
+
+    const __m128i colorMask = _mm_set1_epi32(dibPixelColorMask);
+    const __m128i searchedPixels = _mm_set1_epi32(pixel);
+
+    size_t i = 0;
+    for (; i + 4 <= pixelCount; i += 4) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(pixels + i));
+        __m128i isSearchedColor = _mm_cmpeq_epi32(_mm_and_si128(block, colorMask), searchedPixels);
+        if (_mm_movemask_epi8(isSearchedColor))
+            return true;
+    }
+
+    return ContainsColorScalar(pixels + i, pixelCount - i, pixel);     //remaining pixels
+}
+
+TARGET_ATTRIBUTE("avx2")
+bool ContainsColorAvx2(const uint32_t* pixels, size_t pixelCount, uint32_t pixel) {
+
+    const __m256i colorMask = _mm256_set1_epi32(dibPixelColorMask);
+    const __m256i searchedPixels = _mm256_set1_epi32(pixel);
+
+    bool found = false;
+    size_t i = 0;
+    for (; i + 8 <= pixelCount; i += 8) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(pixels + i));
+        __m256i isSearchedColor = _mm256_cmpeq_epi32(_mm256_and_si256(block, colorMask), searchedPixels);
+        if (_mm256_movemask_epi8(isSearchedColor)) {
+            found = true;
+            break;
+        }
+    }
+
+    _mm256_zeroupper();     //avoid AVX-SSE transition penalties in the code that follows
+
+    return found || ContainsColorScalar(pixels + i, pixelCount - i, pixel);     //remaining pixels
+}
+
+TARGET_ATTRIBUTE("sse2")
+void ApplyColorRulesSse2(uint32_t* pixels, size_t pixelCount, const ColorMappingRule* rules, size_t ruleCount) {
+
+    ruleCount = min(ruleCount, maxColorMappingRules);
+
+    const __m128i colorMask = _mm_set1_epi32(dibPixelColorMask);
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i rulePixels[maxColorMappingRules];
+    __m128i ruleTolerances[maxColorMappingRules];
+    __m128i ruleNewPixels[maxColorMappingRules];
+    for (size_t ruleIndex = 0; ruleIndex < ruleCount; ruleIndex++) {
+        rulePixels[ruleIndex] = _mm_set1_epi32(rules[ruleIndex].pixel);
+        ruleTolerances[ruleIndex] = _mm_set1_epi8((char)min(rules[ruleIndex].tolerance, 255u));
+        ruleNewPixels[ruleIndex] = _mm_set1_epi32(rules[ruleIndex].newPixel);
+    }
+
+    size_t i = 0;
+    for (; i + 4 <= pixelCount; i += 4) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(pixels + i));
+        __m128i colors = _mm_and_si128(block, colorMask);
+        __m128i isMatched = zero;
+
+        for (size_t ruleIndex = 0; ruleIndex < ruleCount; ruleIndex++) {
+            //absolute difference per channel, then check that no channel exceeds the tolerance. The alpha channel difference is always zero since both colours are masked.
+            __m128i difference = _mm_or_si128(
+                _mm_subs_epu8(colors, rulePixels[ruleIndex]),
+                _mm_subs_epu8(rulePixels[ruleIndex], colors)
+            );
+            __m128i excess = _mm_and_si128(_mm_subs_epu8(difference, ruleTolerances[ruleIndex]), colorMask);
+            __m128i isRuleMatch = _mm_andnot_si128(isMatched, _mm_cmpeq_epi32(excess, zero));
+
+            block = _mm_or_si128(
+                _mm_and_si128(isRuleMatch, ruleNewPixels[ruleIndex]),
+                _mm_andnot_si128(isRuleMatch, block)
+            );
+            isMatched = _mm_or_si128(isMatched, isRuleMatch);
+        }
+
+        _mm_storeu_si128((__m128i*)(pixels + i), block);
+    }
+
+    ApplyColorRulesScalar(pixels + i, pixelCount - i, rules, ruleCount);     //remaining pixels
+}
+
+TARGET_ATTRIBUTE("avx2")
+void ApplyColorRulesAvx2(uint32_t* pixels, size_t pixelCount, const ColorMappingRule* rules, size_t ruleCount) {
+
+    ruleCount = min(ruleCount, maxColorMappingRules);
+
+    const __m256i colorMask = _mm256_set1_epi32(dibPixelColorMask);
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256i rulePixels[maxColorMappingRules];
+    __m256i ruleTolerances[maxColorMappingRules];
+    __m256i ruleNewPixels[maxColorMappingRules];
+    for (size_t ruleIndex = 0; ruleIndex < ruleCount; ruleIndex++) {
+        rulePixels[ruleIndex] = _mm256_set1_epi32(rules[ruleIndex].pixel);
+        ruleTolerances[ruleIndex] = _mm256_set1_epi8((char)min(rules[ruleIndex].tolerance, 255u));
+        ruleNewPixels[ruleIndex] = _mm256_set1_epi32(rules[ruleIndex].newPixel);
+    }
+
+    size_t i = 0;
+    for (; i + 8 <= pixelCount; i += 8) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(pixels + i));
+        __m256i colors = _mm256_and_si256(block, colorMask);
+        __m256i isMatched = zero;
+
+        for (size_t ruleIndex = 0; ruleIndex < ruleCount; ruleIndex++) {
+            //absolute difference per channel, then check that no channel exceeds the tolerance. The alpha channel difference is always zero since both colours are masked.
+            __m256i difference = _mm256_or_si256(
+                _mm256_subs_epu8(colors, rulePixels[ruleIndex]),
+                _mm256_subs_epu8(rulePixels[ruleIndex], colors)
+            );
+            __m256i excess = _mm256_and_si256(_mm256_subs_epu8(difference, ruleTolerances[ruleIndex]), colorMask);
+            __m256i isRuleMatch = _mm256_andnot_si256(isMatched, _mm256_cmpeq_epi32(excess, zero));
+
+            block = _mm256_blendv_epi8(block, ruleNewPixels[ruleIndex], isRuleMatch);
+            isMatched = _mm256_or_si256(isMatched, isRuleMatch);
+        }
+
+        _mm256_storeu_si256((__m256i*)(pixels + i), block);
+    }
+
+    _mm256_zeroupper();     //avoid AVX-SSE transition penalties in the code that follows
+
+    ApplyColorRulesScalar(pixels + i, pixelCount - i, rules, ruleCount);     //remaining pixels
+}
+
+TARGET_ATTRIBUTE("xsave")
+unsigned long long ReadXcr0() {
+    return _xgetbv(0);
+}
+
+bool CpuSupportsSse2() {
+
+    int cpuInfo[4];
+    __cpuid(cpuInfo, 1);
+    return (cpuInfo[3] & (1 << 26)) != 0;     //EDX bit 26
+}
+
+bool CpuSupportsAvx2() {
+
+    int cpuInfo[4];
+    __cpuid(cpuInfo, 0);
+    if (cpuInfo[0] < 7)     //max supported leaf
+        return false;
+
+    __cpuid(cpuInfo, 1);
+    bool osUsesXsave = (cpuInfo[2] & (1 << 27)) != 0;     //ECX bit 27
+    bool cpuSupportsAvx = (cpuInfo[2] & (1 << 28)) != 0;     //ECX bit 28
+    if (!osUsesXsave || !cpuSupportsAvx)
+        return false;
+
+    if ((ReadXcr0() & 0x6) != 0x6)     //does the OS preserve XMM and YMM registers during context switches?
+        return false;
+
+    __cpuidex(cpuInfo, 7, 0);
+    return (cpuInfo[1] & (1 << 5)) != 0;     //EBX bit 5
+}
+
+#endif  //#ifdef PIXEL_KERNELS_X86
+
+ReplaceColorKernel_t g_replaceColorKernel = ReplaceColorScalar;
+ContainsColorKernel_t g_containsColorKernel = ContainsColorScalar;
+ApplyColorRulesKernel_t g_applyColorRulesKernel = ApplyColorRulesScalar;
+
+void InitPixelKernels() {
+
+#ifdef PIXEL_KERNELS_X86
+    if (CpuSupportsAvx2()) {
+        g_replaceColorKernel = ReplaceColorAvx2;
+        g_containsColorKernel = ContainsColorAvx2;
+        g_applyColorRulesKernel = ApplyColorRulesAvx2;
+        Wh_Log(L"Using AVX2 pixel kernels");
+        return;
+    }
+    else if (CpuSupportsSse2()) {
+        g_replaceColorKernel = ReplaceColorSse2;
+        g_containsColorKernel = ContainsColorSse2;
+        g_applyColorRulesKernel = ApplyColorRulesSse2;
+        Wh_Log(L"Using SSE2 pixel kernels");
+        return;
+    }
+#endif
+
+    g_replaceColorKernel = ReplaceColorScalar;
+    g_containsColorKernel = ContainsColorScalar;
+    g_applyColorRulesKernel = ApplyColorRulesScalar;
+    Wh_Log(L"Using scalar pixel kernels");
+}
+
+
+struct FloodFillSeed {
+    int x;
+    int y;
+};
+
+//Span based (scanline) flood fill working directly on a 32bpp top-down pixel buffer. Has the same semantics as ExtFloodFill with FLOODFILLSURFACE: fills the 4-connected area of surfacePixel colour containing the seed pixel. Stride is in pixels.
+//If filledRuns is not NULL, the filled runs are appended to it in the order they were filled.
+//Returns false if the seed is outside of the buffer or does not have the surface colour, in which case ExtFloodFill would fail as well.
+bool FloodFillSurface(uint32_t* pixels, int width, int height, ptrdiff_t stride, int seedX, int seedY, uint32_t surfacePixel, uint32_t fillPixel, OUT std::vector<PixelRun>* filledRuns = NULL) {
+
+    if (
+        seedX < 0 || seedX >= width
+        || seedY < 0 || seedY >= height
+        || (pixels[seedY * stride + seedX] & dibPixelColorMask) != surfacePixel
+    ) {
+        return false;
+    }
+
+    if ((fillPixel & dibPixelColorMask) == surfacePixel)    //nothing would change visually, and the fill would never terminate since filled pixels would still look like surface pixels
+        return true;
+
+    size_t stackCapacity = 64;
+    size_t stackSize = 0;
+    FloodFillSeed* stack = new(std::nothrow) FloodFillSeed[stackCapacity];
+    if (!stack) {
+        Wh_Log(L"Allocating flood fill stack failed");
+        return false;
+    }
+
+    stack[stackSize++] = { seedX, seedY };
+
+    bool result = true;
+    while (stackSize > 0) {
+
+        FloodFillSeed seed = stack[--stackSize];
+        uint32_t* row = pixels + seed.y * stride;
+        if ((row[seed.x] & dibPixelColorMask) != surfacePixel)   //already filled via another seed
+            continue;
+
+        //find the whole span of surface colour around the seed and fill it
+        int left = seed.x;
+        while (left > 0 && (row[left - 1] & dibPixelColorMask) == surfacePixel)
+            left--;
+        int right = seed.x;
+        while (right < width - 1 && (row[right + 1] & dibPixelColorMask) == surfacePixel)
+            right++;
+
+        for (int x = left; x <= right; x++)
+            row[x] = fillPixel;
+
+        if (filledRuns)
+            filledRuns->push_back({ seed.y, left, right - left + 1 });
+
+        //push one seed per each run of surface colour in the rows above and below the filled span
+        for (int neighbourY = seed.y - 1; neighbourY <= seed.y + 1; neighbourY += 2) {
+
+            if (neighbourY < 0 || neighbourY >= height)
+                continue;
+
+            uint32_t* neighbourRow = pixels + neighbourY * stride;
+            bool inRun = false;
+            for (int x = left; x <= right; x++) {
+
+                bool isSurface = (neighbourRow[x] & dibPixelColorMask) == surfacePixel;
+                if (isSurface && !inRun) {
+
+                    if (stackSize == stackCapacity) {
+
+                        FloodFillSeed* newStack = new(std::nothrow) FloodFillSeed[stackCapacity * 2];
+                        if (!newStack) {
+                            Wh_Log(L"Growing flood fill stack failed");
+                            result = false;
+                            stackSize = 0;
+                            break;
+                        }
+
+                        memcpy(newStack, stack, stackSize * sizeof(FloodFillSeed));
+                        delete[] stack;
+                        stack = newStack;
+                        stackCapacity *= 2;
+                    }
+
+                    stack[stackSize++] = { x, neighbourY };
+                }
+                inRun = isSurface;
+            }
+
+            if (!result)
+                break;
+        }
+
+        if (!result)
+            break;
+    }
+
+    delete[] stack;
+    return result;
+}
+
+//Returns the part of the surface covered by the rect. The rect is clipped to the surface bounds.
+bool GetSubSurface(const PixelSurface& surface, const RECT& rect, OUT PixelSurface* subSurface) {
+
+    int left = max((int)rect.left, 0);
+    int top = max((int)rect.top, 0);
+    int right = min((int)rect.right, surface.width);
+    int bottom = min((int)rect.bottom, surface.height);
+    if (left >= right || top >= bottom)
+        return false;
+
+    subSurface->pixels = surface.pixels + top * surface.stride + left;
+    subSurface->width = right - left;
+    subSurface->height = bottom - top;
+    subSurface->stride = surface.stride;
+    return true;
+}
+
+bool SurfaceContainsColor(const PixelSurface& surface, uint32_t pixel) {
+
+    if (surface.stride == surface.width)    //contiguous rows can be scanned in one go
+        return g_containsColorKernel(surface.pixels, (size_t)surface.width * surface.height, pixel);
+
+    for (int y = 0; y < surface.height; y++) {
+        if (g_containsColorKernel(surface.pixels + y * surface.stride, surface.width, pixel))
+            return true;
+    }
+    return false;
+}
+
+void ClearSurface(const PixelSurface& surface, uint32_t pixel) {
+
+    for (int y = 0; y < surface.height; y++) {
+        uint32_t* row = surface.pixels + y * surface.stride;
+        for (int x = 0; x < surface.width; x++)
+            row[x] = pixel;
+    }
+}
+
+
+//Paint statistics. Collected into the shared memory block only when enabled in the settings. When disabled, the hooks only check whether g_paintStatistics is NULL.
+
+void EnablePaintStatistics(bool enable) {
+
+    if (enable && !g_paintStatisticsView) {
+
+        WCHAR mappingName[128];
+        swprintf_s(mappingName, L"Local\\classic-taskbar-background-fix-statistics-%u", (unsigned int)GetCurrentProcessId());
+
+        g_paintStatisticsMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(PaintStatistics), mappingName);
+        if (!g_paintStatisticsMapping) {
+            Wh_Log(L"CreateFileMappingW failed for paint statistics");
+        }
+        else {
+            g_paintStatisticsView = (PaintStatistics*)MapViewOfFile(g_paintStatisticsMapping, FILE_MAP_WRITE, 0, 0, sizeof(PaintStatistics));
+            if (!g_paintStatisticsView) {
+                Wh_Log(L"MapViewOfFile failed for paint statistics");
+                CloseHandle(g_paintStatisticsMapping);
+                g_paintStatisticsMapping = NULL;
+            }
+            else {
+                //the pages of a new mapping are zero-initialised, which is a valid initial state for all counters
+                g_paintStatisticsView->magic = paintStatisticsMagic;
+                g_paintStatisticsView->version = paintStatisticsVersion;
+                g_paintStatisticsView->size = sizeof(PaintStatistics);
+                g_paintStatisticsView->hookCount = (uint32_t)HookTimingId::count;
+
+                Wh_Log(L"Collecting paint statistics to %ls", mappingName);
+            }
+        }
+    }
+
+    g_paintStatistics.store(enable ? g_paintStatisticsView : NULL);
+}
+
+void ClosePaintStatistics() {
+
+    g_paintStatistics.store(NULL);
+
+    if (g_paintStatisticsView) {
+        UnmapViewOfFile(g_paintStatisticsView);
+        g_paintStatisticsView = NULL;
+    }
+    if (g_paintStatisticsMapping) {
+        CloseHandle(g_paintStatisticsMapping);
+        g_paintStatisticsMapping = NULL;
+    }
+}
+
+inline void AddPaintStatistic(std::atomic<uint64_t> PaintStatistics::* counter, uint64_t value) {
+
+    PaintStatistics* statistics = g_paintStatistics.load(std::memory_order_relaxed);
+    if (statistics)
+        (statistics->*counter).fetch_add(value, std::memory_order_relaxed);
+}
+
+int GetLatencyHistogramBucket(uint64_t microseconds) {
+
+    int bucket = 0;
+    while (microseconds && bucket < latencyHistogramBucketCount - 1) {
+        bucket++;
+        microseconds >>= 1;
+    }
+    return bucket;
+}
+
+//Measures the time from construction until Stop() or destruction, if the statistics collection is enabled
+class HookTimingScope {
+public:
+    HookTimingScope(HookTimingId hookTimingId) {
+
+        statistics = g_paintStatistics.load(std::memory_order_relaxed);
+        hookIndex = (int)hookTimingId;
+
+        if (statistics)
+            QueryPerformanceCounter(&startTime);
+    }
+
+    ~HookTimingScope() {
+        Stop();
+    }
+
+    void Stop() {
+
+        if (!statistics)
+            return;
+
+        LARGE_INTEGER endTime;
+        QueryPerformanceCounter(&endTime);
+
+        uint64_t microseconds = (uint64_t)(endTime.QuadPart - startTime.QuadPart) * 1000000 / (uint64_t)g_performanceFrequency;
+
+        HookTimingStatistics& hookStatistics = statistics->hooks[hookIndex];
+        hookStatistics.callCount.fetch_add(1, std::memory_order_relaxed);
+        hookStatistics.totalMicroseconds.fetch_add(microseconds, std::memory_order_relaxed);
+        hookStatistics.latencyHistogram[GetLatencyHistogramBucket(microseconds)].fetch_add(1, std::memory_order_relaxed);
+
+        statistics = NULL;      //count only once
+    }
+
+private:
+    PaintStatistics* statistics;
+    int hookIndex;
+    LARGE_INTEGER startTime;
+};
+
+
+//Memory DC pool. Taskbar repaints very frequently during hover animations, so reusing the memory DC and bitmap pairs avoids creating and destroying GDI objects for each paint.
+//The bitmaps are DIB sections, so that the background fix can access the pixels in place, without GetDIBits/SetDIBits copies and additional blits.
+
+int RoundUpToMemDCPoolBucket(int size) {
+    return ((size + memDCPoolBucketGranularity - 1) / memDCPoolBucketGranularity) * memDCPoolBucketGranularity;
+}
+
+uint64_t GetMemDCPoolBucketKey(int width, int height) {
+    return ((uint64_t)RoundUpToMemDCPoolBucket(width) << 32) | (uint64_t)RoundUpToMemDCPoolBucket(height);
+}
+
+//Pooled DC-s are compatible with the DC they were created for, so they become obsolete when the colour depth, DPI, or monitor layout changes
+uint64_t GetDisplaySignature(HDC hdc) {
+
+    uint64_t bitsPerPixel = (uint64_t)(GetDeviceCaps(hdc, BITSPIXEL) * GetDeviceCaps(hdc, PLANES)) & 0xFF;
+    uint64_t dpi = (uint64_t)GetDeviceCaps(hdc, LOGPIXELSX) & 0xFFF;
+    uint64_t monitorCount = (uint64_t)GetSystemMetrics(SM_CMONITORS) & 0xF;
+    uint64_t virtualScreenWidth = (uint64_t)GetSystemMetrics(SM_CXVIRTUALSCREEN) & 0xFFFFF;
+    uint64_t virtualScreenHeight = (uint64_t)GetSystemMetrics(SM_CYVIRTUALSCREEN) & 0xFFFFF;
+
+    return bitsPerPixel
+        | (dpi << 8)
+        | (monitorCount << 20)
+        | (virtualScreenWidth << 24)
+        | (virtualScreenHeight << 44);
+}
+
+void DestroyPooledMemDC(PooledMemDC* entry) {
+
+    SelectObject(entry->memDC, entry->oldBitmap);
+    DeleteObject(entry->memBitmap);
+    DeleteDC(entry->memDC);
+
+    {
+        std::lock_guard<std::mutex> guard(g_memDCPoolMutex);
+        g_memDCPoolTotalBytes -= entry->bytes;
+    }
+
+    delete entry;
+}
+
+//Returns a memory DC compatible with referenceHdc, with a selected 32bpp DIB section. If exactSize is false then the bitmap may be bigger than requested.
+PooledMemDC* AcquirePooledMemDC(HDC referenceHdc, int width, int height, bool exactSize) {
+
+    uint64_t displaySignature = GetDisplaySignature(referenceHdc);
+    DWORD threadId = GetCurrentThreadId();
+    uint64_t bucketKey = GetMemDCPoolBucketKey(width, height);
+
+    std::multimap<uint64_t, PooledMemDC*> obsoleteEntries;
+    {
+        std::lock_guard<std::mutex> guard(g_memDCPoolMutex);
+
+        g_memDCPoolAcquireCount++;
+
+        if (displaySignature != g_memDCPoolDisplaySignature) {
+
+            if (!g_memDCPool.empty()) {
+
+                Wh_Log(L"Display configuration changed, flushing memory DC pool");
+
+                //move the obsolete entries out of the pool, they will be destroyed after the mutex is released
+                obsoleteEntries.swap(g_memDCPool);
+                g_memDCPoolIdleBytes = 0;
+            }
+
+            g_memDCPoolDisplaySignature = displaySignature;
+        }
+        else {
+            auto range = g_memDCPool.equal_range(bucketKey);
+            auto candidate = g_memDCPool.end();
+            for (auto it = range.first; it != range.second; ++it) {
+
+                PooledMemDC* entry = it->second;
+                if (
+                    exactSize
+                    ? (entry->width == width && entry->height == height)
+                    : (entry->width >= width && entry->height >= height)
+                ) {
+                    candidate = it;
+                    if (entry->lastThreadId == threadId)    //prefer entries recently used by the same thread, they are more likely to be cache hot
+                        break;
+                }
+            }
+
+            if (candidate != g_memDCPool.end()) {
+
+                PooledMemDC* entry = candidate->second;
+                g_memDCPool.erase(candidate);
+                g_memDCPoolIdleBytes -= entry->bytes;
+                g_memDCPoolHitCount++;
+
+                entry->lastThreadId = threadId;
+                return entry;
+            }
+        }
+    }
+
+    for (auto& item : obsoleteEntries)
+        DestroyPooledMemDC(item.second);
+
+
+    //pool miss, create a new entry
+
+    int allocatedWidth = exactSize ? width : RoundUpToMemDCPoolBucket(width);
+    int allocatedHeight = exactSize ? height : RoundUpToMemDCPoolBucket(height);
+
+    HDC memDC = CreateCompatibleDC(referenceHdc);
+    if (!memDC) {
+        Wh_Log(L"CreateCompatibleDC failed");
+        return NULL;
+    }
+
+    BITMAPINFO bmi = {};
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = allocatedWidth;
+    bmi.bmiHeader.biHeight = -allocatedHeight;   //negative height means top-down row order, which matches the coordinates used by the pixel kernels
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;  //32-bit color depth
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    void* bits = NULL;
+    HBITMAP memBitmap = CreateDIBSection(referenceHdc, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+    if (!memBitmap || !bits) {
+        Wh_Log(L"CreateDIBSection failed");
+        if (memBitmap)
+            DeleteObject(memBitmap);
+        DeleteDC(memDC);
+        return NULL;
+    }
+
+    HGDIOBJ oldBitmap = SelectObject(memDC, memBitmap);
+    if (!oldBitmap) {
+        Wh_Log(L"SelectObject for memBitmap failed");
+        DeleteObject(memBitmap);
+        DeleteDC(memDC);
+        return NULL;
+    }
+
+    SaveDC(memDC);  //the DC state will be restored when the entry is returned to the pool, so that the next user does not inherit clipping regions, selected objects, etc from the previous user
+
+    PooledMemDC* entry = new(std::nothrow) PooledMemDC;
+    if (!entry) {
+        Wh_Log(L"Allocating memory DC pool entry failed");
+        SelectObject(memDC, oldBitmap);
+        DeleteObject(memBitmap);
+        DeleteDC(memDC);
+        return NULL;
+    }
+
+    entry->memDC = memDC;
+    entry->memBitmap = memBitmap;
+    entry->oldBitmap = oldBitmap;
+    entry->pixels = (uint32_t*)bits;
+    entry->width = allocatedWidth;
+    entry->height = allocatedHeight;
+    entry->bytes = (size_t)allocatedWidth * allocatedHeight * sizeof(uint32_t);
+    entry->lastThreadId = threadId;
+    entry->displaySignature = displaySignature;
+
+    AddPaintStatistic(&PaintStatistics::allocatedBytes, entry->bytes);
+
+    {
+        std::lock_guard<std::mutex> guard(g_memDCPoolMutex);
+
+        g_memDCPoolTotalBytes += entry->bytes;
+        if (g_memDCPoolTotalBytes > g_memDCPoolTotalBytesHighWaterMark)
+            g_memDCPoolTotalBytesHighWaterMark = g_memDCPoolTotalBytes;
+    }
+
+    return entry;
+}
+
+//Resets the DC state back to the state at the creation of the entry, so that the next user does not inherit the clipping region, the origins, the selected objects, etc from the previous user
+void ResetPooledMemDCState(PooledMemDC* entry) {
+
+    RestoreDC(entry->memDC, -1);
+    SaveDC(entry->memDC);
+}
+
+void ReleasePooledMemDC(PooledMemDC* entry) {
+
+    if (!entry)
+        return;
+
+    ResetPooledMemDCState(entry);
+
+    {
+        std::lock_guard<std::mutex> guard(g_memDCPoolMutex);
+
+        if (
+            entry->displaySignature == g_memDCPoolDisplaySignature
+            && g_memDCPool.size() < memDCPoolMaxIdleEntries
+            && g_memDCPoolIdleBytes + entry->bytes <= memDCPoolMaxIdleBytes
+        ) {
+            g_memDCPool.insert({ GetMemDCPoolBucketKey(entry->width, entry->height), entry });
+            g_memDCPoolIdleBytes += entry->bytes;
+            return;
+        }
+    }
+
+    DestroyPooledMemDC(entry);
+}
+
+PixelSurface GetPooledMemDCSurface(const PooledMemDC* entry) {
+
+    PixelSurface surface;
+    surface.pixels = entry->pixels;
+    surface.width = entry->width;
+    surface.height = entry->height;
+    surface.stride = entry->width;
+    return surface;
+}
+
+void FlushMemDCPool() {
+
+    std::multimap<uint64_t, PooledMemDC*> pool;
+    {
+        std::lock_guard<std::mutex> guard(g_memDCPoolMutex);
+
+        pool.swap(g_memDCPool);
+        g_memDCPoolIdleBytes = 0;
+
+        Wh_Log(
+            L"Memory DC pool statistics: acquires %llu, hits %llu, high water mark %llu bytes",
+            (unsigned long long)g_memDCPoolAcquireCount,
+            (unsigned long long)g_memDCPoolHitCount,
+            (unsigned long long)g_memDCPoolTotalBytesHighWaterMark
+        );
+    }
+
+    for (auto& item : pool)
+        DestroyPooledMemDC(item.second);
+}
+
+
+//Per-window back buffer cache. BeginPaintHook needs a back buffer with the size of the whole target bitmap, which for an ultrawide taskbar may be megabytes per paint. Each window keeps its back buffer between paints, until the window is resized or destroyed.
+
+//Moves the entries of destroyed windows out of the cache. Needs to be called under g_backBufferCacheMutex. The caller releases the returned back buffers after releasing the mutex.
+void SweepBackBufferCache(OUT std::vector<PooledMemDC*>* evictedBackBuffers) {
+
+    for (auto it = g_backBufferCache.begin(); it != g_backBufferCache.end();) {
+
+        if (!it->second.inUse && !IsWindow(it->first)) {
+
+            g_backBufferCacheBytes -= it->second.backBuffer->bytes;
+            evictedBackBuffers->push_back(it->second.backBuffer);
+            it = g_backBufferCache.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+//Called only while holding g_backBufferCacheMutex
+void SweepBackBufferCacheIfDue(OUT std::vector<PooledMemDC*>* evictedBackBuffers) {
+
+    ULONGLONG now = GetTickCount64();
+    if (now - g_backBufferCacheLastSweepTime >= backBufferCacheSweepInterval) {
+        g_backBufferCacheLastSweepTime = now;
+        SweepBackBufferCache(evictedBackBuffers);
+    }
+}
+
+//Returns NULL if the back buffer is not available or would exceed the memory budget. In that case the window should be painted without back buffer.
+PooledMemDC* AcquireBackBuffer(HWND hWnd, HDC referenceHdc, int width, int height) {
+
+    uint64_t displaySignature = GetDisplaySignature(referenceHdc);
+    size_t bytes = (size_t)width * height * sizeof(uint32_t);
+
+    std::vector<PooledMemDC*> evictedBackBuffers;
+    bool isNestedPaint = false;
+    bool isOverBudget = false;
+    {
+        std::lock_guard<std::mutex> guard(g_backBufferCacheMutex);
+
+        SweepBackBufferCacheIfDue(&evictedBackBuffers);
+
+        auto it = g_backBufferCache.find(hWnd);
+        if (it != g_backBufferCache.end()) {
+
+            BackBufferCacheEntry& entry = it->second;
+            if (entry.inUse) {     //nested paint of the same window, very unlikely. Use a temporary back buffer.
+
+                isNestedPaint = true;
+            }
+            else if (
+                entry.backBuffer->width == width
+                && entry.backBuffer->height == height
+                && entry.backBuffer->displaySignature == displaySignature
+            ) {
+                entry.inUse = true;
+                g_backBufferCacheHitCount++;
+                return entry.backBuffer;
+            }
+            else {  //the window was resized or display configuration changed
+                g_backBufferCacheBytes -= entry.backBuffer->bytes;
+                evictedBackBuffers.push_back(entry.backBuffer);
+                g_backBufferCache.erase(it);
+            }
+        }
+
+        g_backBufferCacheMissCount++;
+
+        if (
+            g_backBufferCacheBudget
+            && g_backBufferCacheBytes + bytes > g_backBufferCacheBudget
+        ) {
+            SweepBackBufferCache(&evictedBackBuffers);     //maybe there are destroyed windows in the cache
+
+            if (g_backBufferCacheBytes + bytes > g_backBufferCacheBudget) {
+                g_backBufferCacheOverBudgetCount++;
+                isOverBudget = true;
+            }
+        }
+
+        if (!isNestedPaint && !isOverBudget) {
+            //reserve the place in the cache while the mutex is held, so that parallel paints do not exceed the budget
+            g_backBufferCache.insert({ hWnd, { NULL, /*inUse*/true } });
+            g_backBufferCacheBytes += bytes;
+        }
+    }
+
+    for (PooledMemDC* evictedBackBuffer : evictedBackBuffers)
+        ReleasePooledMemDC(evictedBackBuffer);
+
+    if (isOverBudget)
+        return NULL;    //paint without back buffer
+    else if (isNestedPaint)
+        return AcquirePooledMemDC(referenceHdc, width, height, /*exactSize*/true);     //temporary back buffer, not cached
+
+    PooledMemDC* backBuffer = AcquirePooledMemDC(referenceHdc, width, height, /*exactSize*/true);
+    {
+        std::lock_guard<std::mutex> guard(g_backBufferCacheMutex);
+
+        auto it = g_backBufferCache.find(hWnd);
+        if (backBuffer) {
+            it->second.backBuffer = backBuffer;
+        }
+        else {
+            g_backBufferCacheBytes -= bytes;
+            g_backBufferCache.erase(it);
+        }
+    }
+
+    return backBuffer;
+}
+
+void ReleaseBackBuffer(HWND hWnd, PooledMemDC* backBuffer) {
+
+    std::vector<PooledMemDC*> evictedBackBuffers;
+    bool isCached = false;
+    {
+        std::lock_guard<std::mutex> guard(g_backBufferCacheMutex);
+
+        auto it = g_backBufferCache.find(hWnd);
+        if (
+            it != g_backBufferCache.end()
+            && it->second.backBuffer == backBuffer
+        ) {
+            ResetPooledMemDCState(backBuffer);     //the next paint of the window gets the back buffer in the same state as a pooled one
+            it->second.inUse = false;
+            isCached = true;
+        }
+
+        SweepBackBufferCacheIfDue(&evictedBackBuffers);
+    }
+
+    for (PooledMemDC* evictedBackBuffer : evictedBackBuffers)
+        ReleasePooledMemDC(evictedBackBuffer);
+
+    if (!isCached)
+        ReleasePooledMemDC(backBuffer);     //a temporary back buffer
+}
+
+//Releases the idle cached back buffers. Used when the budget setting changes and during mod unload.
+void FlushBackBufferCache() {
+
+    std::vector<PooledMemDC*> evictedBackBuffers;
+    {
+        std::lock_guard<std::mutex> guard(g_backBufferCacheMutex);
+
+        for (auto it = g_backBufferCache.begin(); it != g_backBufferCache.end();) {
+
+            if (!it->second.inUse) {
+                g_backBufferCacheBytes -= it->second.backBuffer->bytes;
+                evictedBackBuffers.push_back(it->second.backBuffer);
+                it = g_backBufferCache.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+
+        Wh_Log(
+            L"Back buffer cache statistics: hits %llu, misses %llu, over budget %llu, bytes held %llu",
+            (unsigned long long)g_backBufferCacheHitCount,
+            (unsigned long long)g_backBufferCacheMissCount,
+            (unsigned long long)g_backBufferCacheOverBudgetCount,
+            (unsigned long long)g_backBufferCacheBytes
+        );
+    }
+
+    for (PooledMemDC* evictedBackBuffer : evictedBackBuffers)
+        ReleasePooledMemDC(evictedBackBuffer);
+}
+
+
+//Orders the runs in memory order
+bool IsPixelRunBefore(const PixelRun& run1, const PixelRun& run2) {
+    return run1.y < run2.y || (run1.y == run2.y && run1.x < run2.x);
+}
+
+uint64_t GetBackgroundMaskCacheKey(int width, int height, int colorIndex, bool isHorisontal) {
+    return ((uint64_t)width & 0xFFFFFF)
+        | (((uint64_t)height & 0xFFFFFF) << 24)
+        | (((uint64_t)colorIndex & 0xFF) << 48)
+        | ((uint64_t)(isHorisontal ? 1 : 0) << 56);
+}
+
+std::shared_ptr<const std::vector<PixelRun>> FindBackgroundMask(uint64_t key, uint64_t displaySignature) {
+
+    std::lock_guard<std::mutex> guard(g_backgroundMaskCacheMutex);
+
+    if (displaySignature != g_backgroundMaskCacheDisplaySignature) {     //DPI or display configuration changed, so the button geometry will change as well
+        g_backgroundMaskCache.clear();
+        g_backgroundMaskCacheDisplaySignature = displaySignature;
+    }
+
+    g_backgroundMaskCacheLookupCount++;
+
+    auto it = g_backgroundMaskCache.find(key);
+    if (it == g_backgroundMaskCache.end())
+        return NULL;
+
+    it->second.lastUse = ++g_backgroundMaskCacheUseCounter;
+    return it->second.runs;
+}
+
+void StoreBackgroundMask(uint64_t key, uint64_t displaySignature, std::vector<PixelRun>&& runs) {
+
+    if (runs.empty() || runs.size() > backgroundMaskMaxRuns)
+        return;
+
+    //sort the runs in memory order so that applying the mask accesses the pixels sequentially
+    std::sort(runs.begin(), runs.end(), IsPixelRunBefore);
+
+    auto mask = std::make_shared<const std::vector<PixelRun>>(std::move(runs));
+
+    std::lock_guard<std::mutex> guard(g_backgroundMaskCacheMutex);
+
+    if (displaySignature != g_backgroundMaskCacheDisplaySignature)
+        return;
+
+    auto it = g_backgroundMaskCache.find(key);
+    if (it == g_backgroundMaskCache.end() && g_backgroundMaskCache.size() >= backgroundMaskCacheMaxEntries) {
+
+        //evict the least recently used entry
+        auto lruIt = g_backgroundMaskCache.begin();
+        for (auto candidateIt = g_backgroundMaskCache.begin(); candidateIt != g_backgroundMaskCache.end(); ++candidateIt) {
+            if (candidateIt->second.lastUse < lruIt->second.lastUse)
+                lruIt = candidateIt;
+        }
+        g_backgroundMaskCache.erase(lruIt);
+    }
+
+    BackgroundMaskCacheEntry& entry = g_backgroundMaskCache[key];
+    entry.runs = std::move(mask);
+    entry.lastUse = ++g_backgroundMaskCacheUseCounter;
+}
+
+void FlushBackgroundMaskCache() {
+
+    std::lock_guard<std::mutex> guard(g_backgroundMaskCacheMutex);
+
+    g_backgroundMaskCache.clear();
+
+    Wh_Log(
+        L"Background mask cache statistics: lookups %llu, hits %llu, mismatches %llu",
+        (unsigned long long)g_backgroundMaskCacheLookupCount,
+        (unsigned long long)g_backgroundMaskCacheHitCount.load(),
+        (unsigned long long)g_backgroundMaskCacheMismatchCount.load()
+    );
+}
+
+//The runs must be sorted in memory order
+bool IsPixelInBackgroundMask(const std::vector<PixelRun>& runs, int x, int y) {
+
+    auto it = std::upper_bound(runs.begin(), runs.end(), PixelRun{ y, x, 0 }, IsPixelRunBefore);
+    if (it == runs.begin())
+        return false;
+
+    --it;
+    return it->y == y && x < it->x + it->length;
+}
+
+//Applies a cached flood fill result without discovering the background again. The mask is validated at a bounded number of pixels only: the run endpoints and every n-th pixel inside the runs must have the old colour, the pixels bordering the runs horizontally must not have the old colour, and every n-th old colour pixel bordering the runs vertically must belong to the mask. This catches the geometry changes, for example a button being resized or moved. Returns false without modifying any pixels if the validation fails, then the caller needs to do the full flood fill.
+bool ApplyBackgroundMask(const PixelSurface& target, const std::vector<PixelRun>& runs, uint32_t oldPixel, uint32_t newPixel) {
+
+    for (const PixelRun& run : runs) {
+
+        int runEnd = run.x + run.length;
+        if (run.y >= target.height || runEnd > target.width)
+            return false;
+
+        const uint32_t* row = target.pixels + run.y * target.stride;
+        if (
+            (row[run.x] & dibPixelColorMask) != oldPixel
+            || (row[runEnd - 1] & dibPixelColorMask) != oldPixel
+            || (run.x > 0 && (row[run.x - 1] & dibPixelColorMask) == oldPixel)
+            || (runEnd < target.width && (row[runEnd] & dibPixelColorMask) == oldPixel)
+        ) {
+            return false;
+        }
+
+        for (int x = run.x + backgroundMaskSampleStep; x < runEnd; x += backgroundMaskSampleStep) {
+            if ((row[x] & dibPixelColorMask) != oldPixel)
+                return false;
+        }
+
+        for (int neighbourY = run.y - 1; neighbourY <= run.y + 1; neighbourY += 2) {
+
+            if (neighbourY < 0 || neighbourY >= target.height)
+                continue;
+
+            const uint32_t* neighbourRow = target.pixels + neighbourY * target.stride;
+            for (int x = run.x; x < runEnd; x += backgroundMaskSampleStep) {
+                if (
+                    (neighbourRow[x] & dibPixelColorMask) == oldPixel
+                    && !IsPixelInBackgroundMask(runs, x, neighbourY)
+                ) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    for (const PixelRun& run : runs) {
+        uint32_t* row = target.pixels + run.y * target.stride;
+        std::fill(row + run.x, row + run.x + run.length, newPixel);
+    }
+
+    return true;
+}
+
+void ClosePaintCaptureFile() {
+
+    std::lock_guard<std::mutex> guard(g_paintCaptureMutex);
+
+    if (g_paintCaptureView) {
+        PaintCaptureFileHeader* header = (PaintCaptureFileHeader*)g_paintCaptureView;
+        Wh_Log(L"Closing paint capture file with %llu records", (unsigned long long)header->recordCount);
+
+        FlushViewOfFile(g_paintCaptureView, 0);
+        UnmapViewOfFile(g_paintCaptureView);
+        g_paintCaptureView = NULL;
+    }
+    if (g_paintCaptureFileMapping) {
+        CloseHandle(g_paintCaptureFileMapping);
+        g_paintCaptureFileMapping = NULL;
+    }
+    if (g_paintCaptureFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(g_paintCaptureFile);
+        g_paintCaptureFile = INVALID_HANDLE_VALUE;
+    }
+    g_paintCaptureFilePath[0] = L'\0';
+}
+
+//If the same file is already open then the capture continues in it. If only the size changed then the existing records are kept as well, as long as they fit into the new size. A different path starts a new capture and overwrites the file.
+void OpenPaintCaptureFile(PCWSTR path, uint64_t fileSize) {
+
+    bool isSamePath;
+    {
+        std::lock_guard<std::mutex> guard(g_paintCaptureMutex);
+
+        isSamePath = g_paintCaptureView && _wcsicmp(g_paintCaptureFilePath, path) == 0;
+        if (
+            isSamePath
+            && ((PaintCaptureFileHeader*)g_paintCaptureView)->fileSize == fileSize
+        ) {
+            return;
+        }
+    }
+
+    ClosePaintCaptureFile();
+
+    if (
+        fileSize < sizeof(PaintCaptureFileHeader)
+        || wcslen(path) >= ARRAYSIZE(g_paintCaptureFilePath)
+    ) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(g_paintCaptureMutex);
+
+    g_paintCaptureFile = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, isSamePath ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (g_paintCaptureFile == INVALID_HANDLE_VALUE) {
+        Wh_Log(L"Creating paint capture file failed: %ls", path);
+        return;
+    }
+
+    //the mapping allocates the whole file size up front, so that the records can be appended with plain memory writes
+    g_paintCaptureFileMapping = CreateFileMappingW(g_paintCaptureFile, NULL, PAGE_READWRITE, (DWORD)(fileSize >> 32), (DWORD)fileSize, NULL);
+    if (!g_paintCaptureFileMapping) {
+        Wh_Log(L"CreateFileMappingW failed for paint capture file");
+    }
+    else {
+        g_paintCaptureView = (BYTE*)MapViewOfFile(g_paintCaptureFileMapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)fileSize);
+        if (!g_paintCaptureView) {
+            Wh_Log(L"MapViewOfFile failed for paint capture file");
+        }
+        else {
+            PaintCaptureFileHeader* header = (PaintCaptureFileHeader*)g_paintCaptureView;
+            if (
+                isSamePath
+                && header->magic == paintCaptureFileMagic
+                && header->version == paintCaptureFileVersion
+                && header->dataSize >= sizeof(PaintCaptureFileHeader)
+                && header->dataSize <= fileSize
+            ) {
+                header->fileSize = fileSize;
+
+                Wh_Log(L"Continuing paint capture to %ls with %llu records", path, (unsigned long long)header->recordCount);
+            }
+            else {
+                header->magic = paintCaptureFileMagic;
+                header->version = paintCaptureFileVersion;
+                header->fileSize = fileSize;
+                header->dataSize = sizeof(PaintCaptureFileHeader);
+                header->recordCount = 0;
+
+                Wh_Log(L"Capturing paints to %ls", path);
+            }
+
+            g_paintCaptureFileFullLogged = false;
+            wcscpy(g_paintCaptureFilePath, path);     //the length was checked above
+            return;
+        }
+
+        CloseHandle(g_paintCaptureFileMapping);
+        g_paintCaptureFileMapping = NULL;
+    }
+
+    CloseHandle(g_paintCaptureFile);
+    g_paintCaptureFile = INVALID_HANDLE_VALUE;
+}
+
+bool IsPaintCaptureEnabled() {
+    std::lock_guard<std::mutex> guard(g_paintCaptureMutex);
+    return g_paintCaptureView != NULL;
+}
+
+//Appends the surface pixels to the runs as pairs of run length and pixel. Runs continue across the rows.
+void RunLengthEncodePixels(const PixelSurface& surface, OUT std::vector<uint32_t>* runs) {
+
+    runs->clear();
+
+    for (int y = 0; y < surface.height; y++) {
+        const uint32_t* row = surface.pixels + y * surface.stride;
+        for (int x = 0; x < surface.width; x++) {
+            if (!runs->empty() && runs->back() == row[x] && (*runs)[runs->size() - 2] < UINT32_MAX) {
+                (*runs)[runs->size() - 2]++;
+            }
+            else {
+                runs->push_back(1);
+                runs->push_back(row[x]);
+            }
+        }
+    }
+}
+
+void AppendPaintCaptureRecord(HWND hWnd, const RECT& paintRect, int colorIndex, const PixelSurface& capturedSurface, const std::vector<uint32_t>& beforeRuns, const std::vector<uint32_t>& afterRuns) {
+
+    PaintCaptureRecordHeader record = {};
+    record.colorIndex = colorIndex;
+    record.tickCount = GetTickCount64();
+    if (!GetClassNameW(hWnd, record.className, ARRAYSIZE(record.className)))
+        record.className[0] = L'\0';
+    record.paintRect = paintRect;
+    record.width = capturedSurface.width;
+    record.height = capturedSurface.height;
+    record.beforeRunCount = (uint32_t)(beforeRuns.size() / 2);
+    record.afterRunCount = (uint32_t)(afterRuns.size() / 2);
+
+    uint64_t recordSize = sizeof(record) + (beforeRuns.size() + afterRuns.size()) * sizeof(uint32_t);
+    record.recordSize = (uint32_t)recordSize;
+
+
+    std::lock_guard<std::mutex> guard(g_paintCaptureMutex);
+
+    if (!g_paintCaptureView)
+        return;
+
+    PaintCaptureFileHeader* header = (PaintCaptureFileHeader*)g_paintCaptureView;
+    if (recordSize > UINT32_MAX || header->dataSize + recordSize > header->fileSize) {
+        if (!g_paintCaptureFileFullLogged) {
+            Wh_Log(L"Paint capture file is full after %llu records", (unsigned long long)header->recordCount);
+            g_paintCaptureFileFullLogged = true;
+        }
+        return;
+    }
+
+    BYTE* destination = g_paintCaptureView + header->dataSize;
+    memcpy(destination, &record, sizeof(record));
+    destination += sizeof(record);
+    memcpy(destination, beforeRuns.data(), beforeRuns.size() * sizeof(uint32_t));
+    destination += beforeRuns.size() * sizeof(uint32_t);
+    memcpy(destination, afterRuns.data(), afterRuns.size() * sizeof(uint32_t));
+
+    //update the header only after the record is complete, so that a reader never sees a partial record
+    header->dataSize += recordSize;
+    header->recordCount++;
+}
+
+//Processes the stripes of the current job until none are left. The lock must be held on entry and is held on exit.
+void RunPixelWorkerStripes(std::unique_lock<std::mutex>& lock) {
+
+    while (g_pixelWorkerJobNextStripe < g_pixelWorkerJobStripeCount) {
+
+        size_t stripeIndex = g_pixelWorkerJobNextStripe++;
+        size_t stripeCount = g_pixelWorkerJobStripeCount;
+        PixelSurface surface = g_pixelWorkerJobSurface;
+        SurfaceStripeFunction_t function = g_pixelWorkerJobFunction;
+        void* context = g_pixelWorkerJobContext;
+
+        lock.unlock();
+
+        int top = (int)(surface.height * stripeIndex / stripeCount);
+        int bottom = (int)(surface.height * (stripeIndex + 1) / stripeCount);
+
+        PixelSurface stripe = surface;
+        stripe.pixels = surface.pixels + top * surface.stride;
+        stripe.height = bottom - top;
+        if (stripe.height > 0)
+            function(stripe, context);
+
+        lock.lock();
+
+        if (--g_pixelWorkerJobStripesRemaining == 0)
+            g_pixelWorkerPoolJobDone.notify_all();
+    }
+}
+
+DWORD WINAPI PixelWorkerThreadFunc(LPVOID param) {
+
+    std::unique_lock<std::mutex> lock(g_pixelWorkerPoolMutex);
+
+    while (true) {
+
+        g_pixelWorkerPoolWakeup.wait(lock, []() {
+            return g_pixelWorkerPoolStop || g_pixelWorkerJobNextStripe < g_pixelWorkerJobStripeCount;
+        });
+
+        if (g_pixelWorkerPoolStop)
+            return 0;
+
+        RunPixelWorkerStripes(lock);
+    }
+}
+
+//Called only while holding g_pixelWorkerJobMutex
+bool EnsurePixelWorkerThreads() {
+
+    if (g_pixelWorkerThreadCount > 0)
+        return true;
+
+    size_t processorCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    size_t threadCount = min(processorCount > 1 ? processorCount - 1 : 0, maxPixelWorkerThreads);     //the calling thread processes a stripe as well
+
+    for (size_t i = 0; i < threadCount; i++) {
+
+        HANDLE thread = CreateThread(NULL, 0, PixelWorkerThreadFunc, NULL, 0, NULL);
+        if (!thread) {
+            Wh_Log(L"CreateThread failed for pixel worker thread");
+            break;
+        }
+
+        std::lock_guard<std::mutex> guard(g_pixelWorkerPoolMutex);
+        g_pixelWorkerThreads[g_pixelWorkerThreadCount++] = thread;
+    }
+
+    if (g_pixelWorkerThreadCount > 0)
+        Wh_Log(L"Started %u pixel worker threads", (unsigned int)g_pixelWorkerThreadCount);
+
+    return g_pixelWorkerThreadCount > 0;
+}
+
+void StopPixelWorkerThreads() {
+
+    std::lock_guard<std::mutex> jobGuard(g_pixelWorkerJobMutex);
+
+    {
+        std::lock_guard<std::mutex> guard(g_pixelWorkerPoolMutex);
+        g_pixelWorkerPoolStop = true;
+    }
+    g_pixelWorkerPoolWakeup.notify_all();
+
+    for (size_t i = 0; i < g_pixelWorkerThreadCount; i++) {
+        WaitForSingleObject(g_pixelWorkerThreads[i], INFINITE);
+        CloseHandle(g_pixelWorkerThreads[i]);
+    }
+    g_pixelWorkerThreadCount = 0;
+}
+
+//Calls the function for horisontal stripes of the surface in parallel if the surface is large enough and parallel processing is enabled, otherwise calls it once for the whole surface. The function must not depend on the pixels outside of its stripe.
+void ProcessSurfaceStriped(const PixelSurface& surface, SurfaceStripeFunction_t function, void* context) {
+
+    if (
+        !g_parallelPixelProcessingEnabled.load(std::memory_order_relaxed)
+        || (size_t)surface.width * surface.height < parallelPixelProcessingMinPixels
+        || !g_pixelWorkerJobMutex.try_lock()
+    ) {
+        function(surface, context);
+        return;
+    }
+
+    std::lock_guard<std::mutex> jobGuard(g_pixelWorkerJobMutex, std::adopt_lock);
+
+    if (g_pixelWorkerPoolStop || !EnsurePixelWorkerThreads()) {
+        function(surface, context);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(g_pixelWorkerPoolMutex);
+
+    g_pixelWorkerJobSurface = surface;
+    g_pixelWorkerJobFunction = function;
+    g_pixelWorkerJobContext = context;
+    g_pixelWorkerJobStripeCount = g_pixelWorkerThreadCount + 1;
+    g_pixelWorkerJobNextStripe = 0;
+    g_pixelWorkerJobStripesRemaining = g_pixelWorkerJobStripeCount;
+
+    g_pixelWorkerPoolWakeup.notify_all();
+
+    RunPixelWorkerStripes(lock);
+
+    g_pixelWorkerPoolJobDone.wait(lock, []() {
+        return g_pixelWorkerJobStripesRemaining == 0;
+    });
+
+    g_pixelWorkerJobStripeCount = 0;
+    g_pixelWorkerJobNextStripe = 0;
+}
+
+//Subtracts the rect from each rect in the set. The resulting rects do not overlap each other if the original ones did not.
+void SubtractRectFromRectSet(std::vector<RECT>* rects, const RECT& subtrahend) {
+
+    std::vector<RECT> result;
+    result.reserve(rects->size() + 4);
+
+    for (const RECT& rect : *rects) {
+
+        RECT intersection = {
+            max(rect.left, subtrahend.left),
+            max(rect.top, subtrahend.top),
+            min(rect.right, subtrahend.right),
+            min(rect.bottom, subtrahend.bottom)
+        };
+        if (intersection.left >= intersection.right || intersection.top >= intersection.bottom) {
+            result.push_back(rect);
+            continue;
+        }
+
+        //split the remaining area into up to four non-overlapping bands: above, below, left and right of the intersection
+        if (rect.top < intersection.top)
+            result.push_back({ rect.left, rect.top, rect.right, intersection.top });
+        if (intersection.bottom < rect.bottom)
+            result.push_back({ rect.left, intersection.bottom, rect.right, rect.bottom });
+        if (rect.left < intersection.left)
+            result.push_back({ rect.left, intersection.top, intersection.left, intersection.bottom });
+        if (intersection.right < rect.right)
+            result.push_back({ intersection.right, intersection.top, rect.right, intersection.bottom });
+    }
+
+    rects->swap(result);
+}
+
+//Returns the parts of the bounds rect which are not covered by any of the rects
+std::vector<RECT> GetRectSetComplement(const RECT& bounds, const RECT* rects, size_t rectCount) {
+
+    std::vector<RECT> complement;
+    if (bounds.left < bounds.right && bounds.top < bounds.bottom)
+        complement.push_back(bounds);
+
+    for (size_t i = 0; i < rectCount; i++) {
+        if (complement.empty())
+            break;
+        SubtractRectFromRectSet(&complement, rects[i]);
+    }
+
+    return complement;
+}
+
+typedef struct tagReplaceColorStripeContext {
+    uint32_t oldPixel;
+    uint32_t newPixel;
+} ReplaceColorStripeContext;
+
+void ReplaceColorStripe(const PixelSurface& stripe, void* context) {
+
+    const ReplaceColorStripeContext* replaceContext = (const ReplaceColorStripeContext*)context;
+    for (int y = 0; y < stripe.height; y++)
+        g_replaceColorKernel(stripe.pixels + y * stripe.stride, stripe.width, replaceContext->oldPixel, replaceContext->newPixel);
+}
+
+typedef struct tagApplyColorRulesStripeContext {
+    const ColorMappingRule* rules;
+    size_t ruleCount;
+} ApplyColorRulesStripeContext;
+
+void ApplyColorRulesStripe(const PixelSurface& stripe, void* context) {
+
+    const ApplyColorRulesStripeContext* rulesContext = (const ApplyColorRulesStripeContext*)context;
+    for (int y = 0; y < stripe.height; y++)
+        g_applyColorRulesKernel(stripe.pixels + y * stripe.stride, stripe.width, rulesContext->rules, rulesContext->ruleCount);
+}
+
+//Modifies the surface pixels in place. The rect is in surface coordinates.
+//If useMaskCache is true, the flood fill result is cached per paint size, colour index and surface orientation, and reused by the later paints of the same size.
+void ConditionalFillRect(const PixelSurface& surface, const RECT& rect, COLORREF oldColor, COLORREF newColor, bool useFloodFill, bool useMaskCache, int colorIndex, uint64_t displaySignature) {
+
+    PixelSurface target;
+    if (!GetSubSurface(surface, rect, &target)) {
+        //Wh_Log(L"pixelCount == 0");
+        return;
+    }
+
+    uint32_t oldPixel = ColorRefToDibPixel(oldColor);
+    uint32_t newPixel = ColorRefToDibPixel(newColor);
+
+    //Paints that do not contain the old colour at all are common, for example clock ticks and icon updates. The flood fill checks the seed pixel first and returns immediately if it does not have the old colour, so the scan is needed only for the per-pixel path. For the flood fill path the scan would be slower than the seed check.
+    if (useFloodFill) {
+
+        //start from bottom right corner
+        int seedX = target.width - 1;
+        int seedY = target.height - 1;
+
+        if ((target.pixels[seedY * target.stride + seedX] & dibPixelColorMask) != oldPixel) {     //the flood fill would do nothing
+            AddPaintStatistic(&PaintStatistics::fillsSkipped, 1);
+        }
+        else if (
+            !useMaskCache
+            || oldPixel == newPixel
+        ) {
+            FloodFillSurface(target.pixels, target.width, target.height, target.stride, seedX, seedY, oldPixel, newPixel);
+        }
+        else {
+            uint64_t key = GetBackgroundMaskCacheKey(target.width, target.height, colorIndex, /*isHorisontal*/surface.width > surface.height);
+            std::shared_ptr<const std::vector<PixelRun>> mask = FindBackgroundMask(key, displaySignature);
+
+            if (mask && ApplyBackgroundMask(target, *mask, oldPixel, newPixel)) {
+                g_backgroundMaskCacheHitCount++;
+            }
+            else {
+                if (mask)
+                    g_backgroundMaskCacheMismatchCount++;
+
+                std::vector<PixelRun> filledRuns;
+                FloodFillSurface(target.pixels, target.width, target.height, target.stride, seedX, seedY, oldPixel, newPixel, &filledRuns);
+                StoreBackgroundMask(key, displaySignature, std::move(filledRuns));
+            }
+        }
+    }
+    else if (SurfaceContainsColor(target, oldPixel)) {      //use conditional colour replacement on all pixels
+
+        ReplaceColorStripeContext context = { oldPixel, newPixel };
+        ProcessSurfaceStriped(target, ReplaceColorStripe, &context);
+    }
+    else {
+        AddPaintStatistic(&PaintStatistics::fillsSkipped, 1);
+    }
+}
+
+//Flood fills the old colour in the rect, starting from the bottom right corner of each seed rect. The rects are in surface coordinates. The fill is not limited to the seed rects, but is limited to the rect.
+void FloodFillFromRects(const PixelSurface& surface, const RECT& rect, const std::vector<RECT>& seedRects, COLORREF oldColor, COLORREF newColor) {
+
+    PixelSurface target;
+    if (!GetSubSurface(surface, rect, &target))
+        return;
+
+    int targetLeft = max((int)rect.left, 0);
+    int targetTop = max((int)rect.top, 0);
+
+    uint32_t oldPixel = ColorRefToDibPixel(oldColor);
+    uint32_t newPixel = ColorRefToDibPixel(newColor);
+
+    bool isAnyFilled = false;
+    for (const RECT& seedRect : seedRects) {
+
+        int seedX = min((int)seedRect.right, targetLeft + target.width) - 1 - targetLeft;
+        int seedY = min((int)seedRect.bottom, targetTop + target.height) - 1 - targetTop;
+
+        //FloodFillSurface returns false without filling if the seed is outside of the target or does not have the old colour, for example when an earlier seed has already filled it
+        if (FloodFillSurface(target.pixels, target.width, target.height, target.stride, seedX, seedY, oldPixel, newPixel))
+            isAnyFilled = true;
+    }
+
+    if (!isAnyFilled)
+        AddPaintStatistic(&PaintStatistics::fillsSkipped, 1);
+}
+
+//Replaces all pixels of the old colour in the rect by compositing the back buffer content over a scratch buffer filled with the new colour, with the old colour as the transparent colour key, and copying the result back. The rect is in back buffer coordinates.
+//The result is the same as with ConditionalFillRect without flood fill, but the pixels are processed by GDI. Call GdiFlush() before accessing the back buffer pixels directly afterwards.
+bool ColorKeyFillRect(HDC referenceHdc, const PooledMemDC* backBuffer, const RECT& rect, COLORREF oldColor, int newColorIndex) {
+
+    RECT target = {
+        max(rect.left, (LONG)0),
+        max(rect.top, (LONG)0),
+        min(rect.right, (LONG)backBuffer->width),
+        min(rect.bottom, (LONG)backBuffer->height)
+    };
+    int width = target.right - target.left;
+    int height = target.bottom - target.top;
+    if (width <= 0 || height <= 0)
+        return true;
+
+    PooledMemDC* scratch = AcquirePooledMemDC(referenceHdc, width, height, /*exactSize*/false);
+    if (!scratch) {
+        Wh_Log(L"Acquiring colour key scratch buffer failed");
+        return false;
+    }
+
+    bool result = false;
+    RECT scratchRect = { 0, 0, width, height };
+
+    SaveDC(backBuffer->memDC);
+    SelectClipRgn(backBuffer->memDC, NULL);     //the painting code may have left a clip region in the back buffer DC
+
+    if (!FillRect(scratch->memDC, &scratchRect, GetSysColorBrush(newColorIndex))) {
+        Wh_Log(L"FillRect failed");
+    }
+    else if (!GdiTransparentBlt(scratch->memDC, 0, 0, width, height, backBuffer->memDC, target.left, target.top, width, height, oldColor)) {
+        Wh_Log(L"GdiTransparentBlt failed");
+    }
+    else if (!BitBlt(backBuffer->memDC, target.left, target.top, width, height, scratch->memDC, 0, 0, SRCCOPY)) {
+        Wh_Log(L"BitBlt failed");
+    }
+    else {
+        result = true;
+    }
+
+    RestoreDC(backBuffer->memDC, -1);
+    ReleasePooledMemDC(scratch);
+    return result;
+}
+
+//Modifies the surface pixels in place. The rect is in surface coordinates.
+void ApplyColorMappingRules(const PixelSurface& surface, const RECT& rect) {
+
+    ColorMappingRuleConfig ruleConfigs[maxColorMappingRules];
+    size_t ruleCount;
+    {
+        std::lock_guard<std::mutex> guard(g_colorMappingRulesMutex);
+        ruleCount = g_colorMappingRuleCount;
+        memcpy(ruleConfigs, g_colorMappingRules, ruleCount * sizeof(ColorMappingRuleConfig));
+    }
+
+    if (ruleCount == 0)
+        return;
+
+    PixelSurface target;
+    if (!GetSubSurface(surface, rect, &target))
+        return;
+
+    ColorMappingRule rules[maxColorMappingRules];
+    for (size_t i = 0; i < ruleCount; i++) {
+        rules[i].pixel = ruleConfigs[i].pixel;
+        rules[i].tolerance = ruleConfigs[i].tolerance;
+        rules[i].newPixel = ColorRefToDibPixel(GetSysColor(ruleConfigs[i].colorIndex));
+    }
+
+    ApplyColorRulesStripeContext context = { rules, ruleCount };
+    ProcessSurfaceStriped(target, ApplyColorRulesStripe, &context);
+}
+
+//Fixes the background and applies the colour mapping rules in the rect of the back buffer. The rect is in back buffer coordinates.
+void FixBackgroundRect(const MemDCInfo& memDCInfo, const PixelSurface& backBufferSurface, const RECT& rect) {
+
+    if (!GetSysColorBrush(memDCInfo.colorIndex)) {        //Verify that the brush is supported by the current system. GetSysColor() does not have return value, so need to use GetSysColorBrush() for verification purposes.
+        Wh_Log(L"GetSysColorBrush failed - is the colour supported by current OS?");
+    }
+    else {
+        COLORREF buttonFace = GetSysColor(memDCInfo.colorIndex);
+        if (buttonFace != black) {
+
+            BackgroundFixMethod method = memDCInfo.backgroundFixMethod;
+
+            if (method == BackgroundFixMethod::colorKey) {
+
+                if (ColorKeyFillRect(memDCInfo.originalHdc, memDCInfo.backBuffer, rect, black, memDCInfo.colorIndex))
+                    GdiFlush();     //the colour mapping rules and paint capture below access the pixels directly
+                else    //fall back to the per-pixel replacement, which has the same result
+                    ConditionalFillRect(backBufferSurface, rect, black, buttonFace, /*useFloodFill*/false, /*useMaskCache*/false, memDCInfo.colorIndex, memDCInfo.backBuffer->displaySignature);
+            }
+            else if (method == BackgroundFixMethod::replaceAll) {
+                ConditionalFillRect(backBufferSurface, rect, black, buttonFace, /*useFloodFill*/false, /*useMaskCache*/false, memDCInfo.colorIndex, memDCInfo.backBuffer->displaySignature);
+            }
+            else if (
+                method == BackgroundFixMethod::automatic
+                && memDCInfo.frameControlRectCount > 0
+                && !memDCInfo.frameControlRectsOverflow
+            ) {
+
+                //The button layout is known from DrawFrameControlHook, which has already painted the button backgrounds. The remaining black background is in the gaps between the buttons. Flood fill from a corner of each gap, so that also the gaps which are not connected to the corner of the paint rect are fixed, while black pixels not connected to the background, like in icons and text, are kept as with the plain flood fill.
+                std::vector<RECT> gapRects = GetRectSetComplement(rect, memDCInfo.frameControlRects, memDCInfo.frameControlRectCount);
+                FloodFillFromRects(backBufferSurface, rect, gapRects, black, buttonFace);
+            }
+            else {
+                ConditionalFillRect(backBufferSurface, rect, black, buttonFace, /*useFloodFill*/true, /*useMaskCache*/true, memDCInfo.colorIndex, memDCInfo.backBuffer->displaySignature);
+            }
+        }
+    }
+
+    ApplyColorMappingRules(backBufferSurface, rect);
+}
+
+//Returns true if the fix result of each pixel depends only on the pixel itself. These methods are cheaper to run again than to compare and copy the remembered pixels.
+bool IsPerPixelBackgroundFix(const MemDCInfo& memDCInfo) {
+
+    return memDCInfo.colorIndex == blackColorIndex
+        || memDCInfo.backgroundFixMethod == BackgroundFixMethod::replaceAll
+        || memDCInfo.backgroundFixMethod == BackgroundFixMethod::colorKey;
+}
+
+inline uint64_t MixHash(uint64_t hash, uint64_t value) {
+
+    hash ^= value;
+    hash *= 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 29);
+}
+
+//Identifies the parameters which the fixed pixels depend on, in addition to the pixels and the layout
+uint64_t GetPaintReuseFixSignature(const MemDCInfo& memDCInfo) {
+
+    uint64_t hash = MixHash(0, (uint64_t)(int64_t)memDCInfo.colorIndex);
+    hash = MixHash(hash, memDCInfo.colorIndex == blackColorIndex ? black : GetSysColor(memDCInfo.colorIndex));
+    hash = MixHash(hash, (uint64_t)memDCInfo.backgroundFixMethod);
+
+    std::lock_guard<std::mutex> guard(g_colorMappingRulesMutex);
+    for (size_t i = 0; i < g_colorMappingRuleCount; i++) {
+        const ColorMappingRuleConfig& rule = g_colorMappingRules[i];
+        hash = MixHash(hash, rule.pixel | ((uint64_t)rule.tolerance << 32));
+        hash = MixHash(hash, GetSysColor(rule.colorIndex));
+    }
+
+    return hash;
+}
+
+void CopySurfaceToPixels(const PixelSurface& surface, OUT std::vector<uint32_t>* pixels) {
+
+    pixels->resize((size_t)surface.width * surface.height);
+    for (int y = 0; y < surface.height; y++)
+        memcpy(pixels->data() + (size_t)y * surface.width, surface.pixels + y * surface.stride, surface.width * sizeof(uint32_t));
+}
+
+void CopyPixelsToSurface(const std::vector<uint32_t>& pixels, const PixelSurface& surface) {
+
+    for (int y = 0; y < surface.height; y++)
+        memcpy(surface.pixels + y * surface.stride, pixels.data() + (size_t)y * surface.width, surface.width * sizeof(uint32_t));
+}
+
+bool IsSurfaceEqualToPixels(const PixelSurface& surface, const std::vector<uint32_t>& pixels) {
+
+    if (pixels.size() != (size_t)surface.width * surface.height)
+        return false;
+
+    for (int y = 0; y < surface.height; y++) {
+        if (memcmp(surface.pixels + y * surface.stride, pixels.data() + (size_t)y * surface.width, surface.width * sizeof(uint32_t)) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+//Removes the window's entry from the map for the duration of the paint. Returns NULL if the window has no entry yet.
+PaintReuseCacheEntry* CheckOutPaintReuseCacheEntry(HWND hWnd) {
+
+    std::lock_guard<std::mutex> guard(g_paintReuseCacheMutex);
+
+    auto it = g_paintReuseCache.find(hWnd);
+    if (it == g_paintReuseCache.end())
+        return NULL;
+
+    PaintReuseCacheEntry* entry = it->second;
+    g_paintReuseCache.erase(it);
+    return entry;
+}
+
+//Returns the window's entry back to the map, evicting the least recently used window if there are too many windows
+void CheckInPaintReuseCacheEntry(HWND hWnd, PaintReuseCacheEntry* entry) {
+
+    PaintReuseCacheEntry* evictedEntry = NULL;
+    {
+        std::lock_guard<std::mutex> guard(g_paintReuseCacheMutex);
+
+        if (!g_paintReuseEnabled.load()) {     //the cache was flushed during the paint
+            evictedEntry = entry;
+        }
+        else {
+            if (g_paintReuseCache.size() >= paintReuseCacheMaxWindows) {
+
+                auto lruIt = g_paintReuseCache.begin();
+                for (auto candidateIt = g_paintReuseCache.begin(); candidateIt != g_paintReuseCache.end(); ++candidateIt) {
+                    if (candidateIt->second->lastUse < lruIt->second->lastUse)
+                        lruIt = candidateIt;
+                }
+                evictedEntry = lruIt->second;
+                g_paintReuseCache.erase(lruIt);
+            }
+
+            entry->lastUse = ++g_paintReuseCacheUseCounter;
+            g_paintReuseCache[hWnd] = entry;
         }
     }
 
-    return callerIsClassicTaskbarButtonsLiteMod;
+    delete evictedEntry;    //free the memory outside of the lock
 }
 
+void FlushPaintReuseCache() {
 
-bool WindowNeedsBackgroundRepaint(OUT int* colorIndex, HWND hWnd, const RECT* paintRect, bool isDrawThemeParentBackgroundCall) {
+    std::map<HWND, PaintReuseCacheEntry*> paintReuseCache;
+    {
+        std::lock_guard<std::mutex> guard(g_paintReuseCacheMutex);
+        paintReuseCache.swap(g_paintReuseCache);
+    }
 
-    WCHAR szClassName[32];
+    for (auto& item : paintReuseCache)
+        delete item.second;
+}
+
+//Like FixBackgroundRect, but copies the remembered fix result if the window repaints the same area with the same content and layout as in its previous paint.
+//Applies only to the flood fill and automatic methods. The per-pixel methods are cheaper to run again than to compare and copy the pixels.
+void FixBackgroundRectWithPaintReuse(const MemDCInfo& memDCInfo, const PixelSurface& backBufferSurface, const RECT& paintRect) {
+
+    PixelSurface paintSurface;
     if (
-        hWnd 
-        && GetClassNameW(hWnd, szClassName, ARRAYSIZE(szClassName))
+        IsPerPixelBackgroundFix(memDCInfo)
+        || !GetSubSurface(backBufferSurface, paintRect, &paintSurface)
+        || (size_t)paintSurface.width * paintSurface.height > paintReuseCacheMaxPixelsPerWindow
     ) {
-        if (
-            isDrawThemeParentBackgroundCall
-            && (
-                g_repaintDesktopButtonConfig == RepaintDesktopButtonConfig::highlightOnHover
-                || g_repaintDesktopButtonConfig == RepaintDesktopButtonConfig::blackOnHover
-            )
-            && _wcsicmp(szClassName, L"TrayShowDesktopButtonWClass") == 0
-        ) {
-            POINT cursorPos;
-            if (GetCursorPos(&cursorPos)) {
-                if (ScreenToClient(
-                    hWnd,
-                    &cursorPos
-                )) {
-                    bool mouseIsOverShowDesktopButton = PtInRect(
-                        paintRect,
-                        cursorPos
-                    );
-
-                    if (mouseIsOverShowDesktopButton) {
-                        if (g_repaintDesktopButtonConfig == RepaintDesktopButtonConfig::highlightOnHover)
-                            *colorIndex = COLOR_HIGHLIGHT;
-                        else
-                            *colorIndex = blackColorIndex;
-                    }
-                    else {
-                        *colorIndex = COLOR_3DFACE;
-                    }
+        FixBackgroundRect(memDCInfo, backBufferSurface, paintRect);
+        return;
+    }
 
-                    return true;
-                }
-            }
-        }
-        else if (
-            isDrawThemeParentBackgroundCall        //painting the "show desktop" button black again since without it earlier calls to DrawThemeParentBackground would remove the black color from "show desktop" button as a side effect of painting other tray areas
-            && g_repaintDesktopButtonConfig == RepaintDesktopButtonConfig::no
-            && _wcsicmp(szClassName, L"TrayShowDesktopButtonWClass") == 0   //show desktop button
-        ) {
-            *colorIndex = blackColorIndex;     
-            return true;
+    PaintReuseCacheEntry* entry = CheckOutPaintReuseCacheEntry(memDCInfo.hWnd);
+    if (!entry) {
+        entry = new(std::nothrow) PaintReuseCacheEntry();
+        if (!entry) {
+            Wh_Log(L"Allocating paint reuse cache entry failed");
+            FixBackgroundRect(memDCInfo, backBufferSurface, paintRect);
+            return;
         }
-        else {
+    }
 
-            bool result =
-                _wcsicmp(szClassName, L"Shell_TrayWnd") == 0        //around of start button in case OpenShell is active
-                || _wcsicmp(szClassName, L"Start") == 0             //around of start button in case OpenShell is NOT active
-                || _wcsicmp(szClassName, L"Shell_SecondaryTrayWnd") == 0        //secondary taskbar
-                || _wcsicmp(szClassName, L"MSTaskListWClass") == 0      //around of taskbar buttons
-                || (
-                    isDrawThemeParentBackgroundCall
-                    && (
-                        _wcsicmp(szClassName, L"CiceroUIWndFrame") == 0     //language bar
-                        || _wcsicmp(szClassName, L"TrayNotifyWnd") == 0     //around of tray, sometimes may be a very thin line, but could be also a wider area
-                        || _wcsicmp(szClassName, L"Button") == 0        //three dots of the "show hidden icons" button
-                        || _wcsicmp(szClassName, L"SysPager") == 0      //visible tray icons
-                        //|| _wcsicmp(szClassName, L"ToolbarWindow32") == 0      //Background of both visible and hidden tray icons. Commenting out in order to not repaint hidden tray icons popup background. Not needed anyway, since painting SysPager class has already the desired effect.
-                        || _wcsicmp(szClassName, L"TrayClockWClass") == 0       //clock
-                        || _wcsicmp(szClassName, L"TrayButton") == 0        //action center button
-                        || (
-                            g_repaintDesktopButtonConfig == RepaintDesktopButtonConfig::yes
-                            && _wcsicmp(szClassName, L"TrayShowDesktopButtonWClass") == 0   //show desktop button
-                        )
-                    )
-                );
+    uint64_t fixSignature = GetPaintReuseFixSignature(memDCInfo);
+    bool isSamePaint = (
+        entry->surfaceWidth == backBufferSurface.width
+        && entry->surfaceHeight == backBufferSurface.height
+        && entry->fixSignature == fixSignature
+        && memcmp(&entry->paintRect, &paintRect, sizeof(RECT)) == 0
+        && entry->frameControlRectsOverflow == memDCInfo.frameControlRectsOverflow
+        && entry->frameControlRects.size() == memDCInfo.frameControlRectCount
+        && (
+            memDCInfo.frameControlRectCount == 0
+            || memcmp(entry->frameControlRects.data(), memDCInfo.frameControlRects, memDCInfo.frameControlRectCount * sizeof(RECT)) == 0
+        )
+        && IsSurfaceEqualToPixels(paintSurface, entry->originalPixels)
+    );
 
-            *colorIndex = COLOR_3DFACE;     //unused if result == false
-            return result;
-        }
+    if (isSamePaint) {
+
+        CopyPixelsToSurface(entry->fixedPixels, paintSurface);
+
+        AddPaintStatistic(&PaintStatistics::paintsReused, 1);
     }
-    
-    return false;
+    else {
+        CopySurfaceToPixels(paintSurface, &entry->originalPixels);
+
+        FixBackgroundRect(memDCInfo, backBufferSurface, paintRect);
+
+        CopySurfaceToPixels(paintSurface, &entry->fixedPixels);
+        entry->surfaceWidth = backBufferSurface.width;
+        entry->surfaceHeight = backBufferSurface.height;
+        entry->fixSignature = fixSignature;
+        entry->paintRect = paintRect;
+        entry->frameControlRects.assign(memDCInfo.frameControlRects, memDCInfo.frameControlRects + memDCInfo.frameControlRectCount);
+        entry->frameControlRectsOverflow = memDCInfo.frameControlRectsOverflow;
+
+        AddPaintStatistic(&PaintStatistics::paintsNotReused, 1);
+    }
+
+    CheckInPaintReuseCacheEntry(memDCInfo.hWnd, entry);
 }
 
-void ConditionalFillRect(HDC hdc, const RECT& rect, COLORREF oldColor, COLORREF newColor, int newColorIndex, bool useFloodFill) {
+MemDCInfo* FindPaintInFlight(HDC memDC) {
 
-    int pixelCount = (rect.right - rect.left) * (rect.bottom - rect.top);
-    if (pixelCount == 0) {
-        //Wh_Log(L"pixelCount == 0");
-        return;
+    for (size_t i = t_paintsInFlightCount; i > 0; i--) {
+        if (t_paintsInFlight[i - 1].backBuffer->memDC == memDC)
+            return &t_paintsInFlight[i - 1];
     }
+    return NULL;
+}
 
-    //Create a compatible DC and bitmap. Even though hdc is already a memDC, we need to create one more memDC, since we need to get access to pixels using ExtFloodFill which does not support providing top-left coordinates, or alternatively, using GetDIBits and SetDIBits, which does not support providing left-right coordinates.
-    HDC memDC = CreateCompatibleDC(hdc);
-    if (!memDC) {
-        Wh_Log(L"CreateCompatibleDC failed");
-        return;
+void RemovePaintInFlightAt(size_t index) {
+
+    for (size_t j = index + 1; j < t_paintsInFlightCount; j++)
+        t_paintsInFlight[j - 1] = t_paintsInFlight[j];
+    t_paintsInFlightCount--;
+}
+
+//Usually the paint is the most recent one, but a mismatched pair is removed from the middle as well. Returns false if the paint was not found.
+bool RemovePaintInFlight(HDC memDC, OUT MemDCInfo* paintInfo) {
+
+    for (size_t i = t_paintsInFlightCount; i > 0; i--) {
+
+        if (t_paintsInFlight[i - 1].backBuffer->memDC == memDC) {
+
+            *paintInfo = t_paintsInFlight[i - 1];
+            RemovePaintInFlightAt(i - 1);
+            return true;
+        }
     }
+    return false;
+}
+
+//Returns false if the allocation fails
+bool EnsurePaintsInFlightAllocated() {
+
+    if (t_paintsInFlight)
+        return true;
 
-    HBITMAP memBitmap = CreateCompatibleBitmap(hdc, rect.right - rect.left, rect.bottom - rect.top);
-    if (!memBitmap) {
-        Wh_Log(L"CreateCompatibleBitmap failed");
+    MemDCInfo* paintsInFlight = new(std::nothrow) MemDCInfo[maxPaintsInFlightPerThread];
+    if (!paintsInFlight) {
+        Wh_Log(L"Allocating in-flight paint records failed");
+        return false;
     }
-    else {
-        HGDIOBJ oldBitmap = SelectObject(memDC, memBitmap);
-        if (!oldBitmap) {
-            Wh_Log(L"SelectObject for memBitmap failed");
-        }
-        else {
-            //copy the existing content from hdc
-            if (!BitBlt(memDC, 0, 0, rect.right - rect.left, rect.bottom - rect.top, hdc, rect.left, rect.top, SRCCOPY)) {
-                Wh_Log(L"BitBlt to memDC failed");
-            }
-            else {
-                if (useFloodFill) {
 
-                    HBRUSH newBrush = GetSysColorBrush(newColorIndex);
-                    if (!newBrush) {
-                        Wh_Log(L"GetSysColorBrush failed - is the colour supported by current OS?");
-                    }
-                    else {
-                        HGDIOBJ oldBrush = SelectObject(memDC, newBrush);
-                        if (!oldBrush) {
-                            Wh_Log(L"SelectObject for newBrush failed");
-                        }
-                        else {
-                            if (!ExtFloodFill(
-                                memDC,
-                                //start from bottom right corner
-                                rect.right - rect.left - 1, //right
-                                rect.bottom - rect.top - 1, //bottom
-                                oldColor,
-                                FLOODFILLSURFACE
-                            )) {
-                                //Wh_Log(L"ExtFloodFill failed");
-                            }
-                            else {
-                                //blit the modified content back to hdc
-                                //TODO: try to blit directly to original hdc, not to memDC from BeginPaint?
-                                if (!BitBlt(hdc, rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top, memDC, 0, 0, SRCCOPY))
-                                    Wh_Log(L"BitBlt to hdc failed");
-                            }
-
-                            SelectObject(memDC, oldBrush);
-                        }
-                    }
-                }
-                else {      //use conditional colour replacement on all pixels
-
-                    //get pixels array from bitmap
-                    BITMAPINFO bmi = {};
-                    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-                    bmi.bmiHeader.biWidth = rect.right - rect.left;
-                    bmi.bmiHeader.biHeight = rect.bottom - rect.top;
-                    bmi.bmiHeader.biPlanes = 1;
-                    bmi.bmiHeader.biBitCount = 32;  //32-bit color depth
-                    bmi.bmiHeader.biCompression = BI_RGB;
-
-                    COLORREF* pixels = new(std::nothrow) COLORREF[pixelCount];
-                    if (!pixels) {
-                        Wh_Log(L"Allocating pixels array failed");
-                    }
-                    else {
-                        int getDIBitsResult = GetDIBits(memDC, memBitmap, 0, rect.bottom - rect.top, pixels, &bmi, DIB_RGB_COLORS);
-                        if (getDIBitsResult == NULL || getDIBitsResult == ERROR_INVALID_PARAMETER) {
-                            Wh_Log(L"GetDIBits failed");
-                            delete[] pixels;
-                        }
-                        else {
-                            //modify the pixels
-                            for (int i = 0; i < pixelCount; ++i) {
-                                if (pixels[i] == oldColor)
-                                    pixels[i] = newColor;
-                            }
-
-                            //save pixels array back to bitmap
-                            int setDIBitsResult = SetDIBits(memDC, memBitmap, 0, rect.bottom - rect.top, pixels, &bmi, DIB_RGB_COLORS);
-                            delete[] pixels;
-
-                            if (setDIBitsResult == NULL || setDIBitsResult == ERROR_INVALID_PARAMETER) {
-                                Wh_Log(L"SetDIBits failed");
-                            }
-                            else {
-                                //blit the modified content back to hdc
-                                //TODO: try to blit directly to original hdc, not to memDC from BeginPaint?
-                                if (!BitBlt(hdc, rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top, memDC, 0, 0, SRCCOPY))
-                                    Wh_Log(L"BitBlt to hdc failed");
-                            }
-                        }
-                    }
-                }
-            }
+    std::lock_guard<std::mutex> guard(g_paintsInFlightAllocationsMutex);
+    g_paintsInFlightAllocations.push_back(paintsInFlight);
+    t_paintsInFlight = paintsInFlight;
+    return true;
+}
 
-            //clean up
-            SelectObject(memDC, oldBitmap);
-            DeleteObject(memBitmap);
-        }
+void FreePaintsInFlightAllocations() {
 
-        DeleteDC(memDC);
+    std::lock_guard<std::mutex> guard(g_paintsInFlightAllocationsMutex);
+
+    for (MemDCInfo* paintsInFlight : g_paintsInFlightAllocations)
+        delete[] paintsInFlight;
+    g_paintsInFlightAllocations.clear();
+}
+
+//Removes the paints of destroyed windows, which will never get their EndPaint call, and releases their back buffers
+void ReclaimAbandonedPaintsInFlight() {
+
+    for (size_t i = t_paintsInFlightCount; i > 0; i--) {
+
+        const MemDCInfo& paintInfo = t_paintsInFlight[i - 1];
+        if (!IsWindow(paintInfo.hWnd)) {
+
+            Wh_Log(L"Reclaiming paint of a destroyed window");
+
+            ReleaseBackBuffer(paintInfo.hWnd, paintInfo.backBuffer);
+            RemovePaintInFlightAt(i - 1);
+        }
     }
 }
 
@@ -507,69 +2955,66 @@ HDC WINAPI BeginPaintHook(
 ) {
     HDC hdc = pOriginalBeginPaint(hWnd, lpPaint);
 
+    HookTimingScope timingScope(HookTimingId::beginPaint);
+
     int originalError = GetLastError();
 
 
     if (hdc != lpPaint->hdc)
         Wh_Log(L"hdc != lpPaint->hdc");
 
+    if (t_paintsInFlightCount == maxPaintsInFlightPerThread)
+        ReclaimAbandonedPaintsInFlight();
+
     int colorIndex;
     if (
         g_hwndTaskbar   //is the current process the taskbar process?
         && lpPaint
         && lpPaint->hdc
+        && t_paintsInFlightCount < maxPaintsInFlightPerThread     //in the unlikely case of too deep nesting, paint directly without the background fix
         && WindowNeedsBackgroundRepaint(&colorIndex, hWnd, &lpPaint->rcPaint, /*isDrawThemeParentBackgroundCall*/false)
+        && EnsurePaintsInFlightAllocated()
     ) {
         //Send memDC to the caller to prevent occasional flickering. With memDC we can repaint the pixels before they are updated on screen.
-        HDC memDC = CreateCompatibleDC(hdc);
-        if (!memDC) {
-            Wh_Log(L"CreateCompatibleDC failed");
+
+        //GetClipBox does not work well here for some reason, causing taskbar buttons to be partially updated
+        BITMAP bitmapHeader = {};
+        HGDIOBJ hBitmap = GetCurrentObject(lpPaint->hdc, OBJ_BITMAP);
+        if (!hBitmap) {
+            Wh_Log(L"GetCurrentObject failed");
         }
         else {
-            //GetClipBox does not work well here for some reason, causing taskbar buttons to be partially updated
-            BITMAP bitmapHeader = {};
-            HGDIOBJ hBitmap = GetCurrentObject(lpPaint->hdc, OBJ_BITMAP);
-            if (!hBitmap) {
-                Wh_Log(L"GetCurrentObject failed");
+            if (!GetObjectW(hBitmap, sizeof(BITMAP), &bitmapHeader)) {
+                Wh_Log(L"GetObjectW failed");
             }
             else {
-                if (!GetObjectW(hBitmap, sizeof(BITMAP), &bitmapHeader)) {
-                    Wh_Log(L"GetObjectW failed");
-                }
-                else {
-                    int width = bitmapHeader.bmWidth;
-                    int height = bitmapHeader.bmHeight;
-
-                    //need full bitmap copy here - could not create a smaller compatible bitmap with only the width and height of lpPaint->rcPaint since that would mess up ClientToScreen coordinates conversion in the program.
-                    HBITMAP memBitmap = CreateCompatibleBitmap(lpPaint->hdc, width, height);
-                    if (!memBitmap) {
-                        Wh_Log(L"CreateCompatibleBitmap failed");
+                int width = bitmapHeader.bmWidth;
+                int height = bitmapHeader.bmHeight;
+
+                //need full bitmap copy here - could not create a smaller compatible bitmap with only the width and height of lpPaint->rcPaint since that would mess up ClientToScreen coordinates conversion in the program.
+                PooledMemDC* backBuffer = AcquireBackBuffer(hWnd, lpPaint->hdc, width, height);
+                if (backBuffer) {
+
+                    //A pooled back buffer contains pixels from an earlier paint. Clear the paint area to black, like it would be in a newly created bitmap, so that the unpainted pixels get the same treatment by the background fix as before.
+                    PixelSurface paintSurface;
+                    if (GetSubSurface(GetPooledMemDCSurface(backBuffer), lpPaint->rcPaint, &paintSurface)) {
+                        GdiFlush();     //make sure that there are no pending GDI operations on the back buffer before accessing its pixels directly
+                        ClearSurface(paintSurface, ColorRefToDibPixel(black));
                     }
-                    else {
-                        HGDIOBJ oldBitmap = SelectObject(memDC, memBitmap);
-                        if (!oldBitmap) {
-                            Wh_Log(L"SelectObject failed");
-                        }
-                        else {
-                            MemDCInfo memDCInfo;
-                            memDCInfo.originalHdc = lpPaint->hdc;
-                            memDCInfo.memBitmap = memBitmap;
-                            memDCInfo.oldBitmap = oldBitmap;
-                            memDCInfo.colorIndex = colorIndex;
-
-                            {
-                                std::lock_guard<std::mutex> guard(g_hdcMapMutex);
-                                g_hdcMap.insert({ memDC, memDCInfo });
-                            }
-
-                            lpPaint->hdc = memDC;
-                            return memDC;
-                        }
 
-                        DeleteObject(memBitmap);
-                    }
+                    MemDCInfo& memDCInfo = t_paintsInFlight[t_paintsInFlightCount++];
+                    memDCInfo.originalHdc = lpPaint->hdc;
+                    memDCInfo.hWnd = hWnd;
+                    memDCInfo.backBuffer = backBuffer;
+                    memDCInfo.colorIndex = colorIndex;
+                    memDCInfo.backgroundFixMethod = GetBackgroundFixMethod(hWnd);
+                    memDCInfo.frameControlRectCount = 0;
+                    memDCInfo.frameControlRectsOverflow = false;
+
+                    HDC memDC = backBuffer->memDC;
 
-                    DeleteDC(memDC);
+                    lpPaint->hdc = memDC;
+                    return memDC;
                 }
             }
         }
@@ -585,37 +3030,43 @@ BOOL WINAPI EndPaintHook(
     IN HWND                 hWnd,
     IN const PAINTSTRUCT*   lpPaint
 ) {
+    HookTimingScope timingScope(HookTimingId::endPaint);
+
     if (
         g_hwndTaskbar   //is the current process the taskbar process?
         && lpPaint
         && lpPaint->hdc
     ) {
         MemDCInfo memDCInfo;
-        bool found = false;
-        {
-            std::lock_guard<std::mutex> guard(g_hdcMapMutex);
+        if (RemovePaintInFlight(lpPaint->hdc, &memDCInfo)) {   //there is a chance that EndPaint gets a call that is paired with BeginPaint from time before hooking or before g_hwndTaskbar was set
 
-            auto it = g_hdcMap.find(lpPaint->hdc);
-            if (it != g_hdcMap.end()) {   //there is a chance that EndPaint gets a call that is paired with BeginPaint from time before hooking or before g_hwndTaskbar was set
-                found = true;
-                memDCInfo = it->second;
-                g_hdcMap.erase(lpPaint->hdc);
-            }
-        }
+            int originalError = GetLastError();
 
-        if (found) {
 
-            int originalError = GetLastError();
+            GdiFlush();     //make sure that GDI has completed drawing to the back buffer before accessing its pixels directly
 
+            //fix the background in place in the back buffer, so that only the blit to the original HDC below is needed
+            PixelSurface backBufferSurface = GetPooledMemDCSurface(memDCInfo.backBuffer);
 
-            if (!GetSysColorBrush(memDCInfo.colorIndex)) {        //Verify that the brush is supported by the current system. GetSysColor() does not have return value, so need to use GetSysColorBrush() for verification purposes.
-                Wh_Log(L"GetSysColorBrush failed - is the colour supported by current OS?");
-            }
-            else {
-                COLORREF buttonFace = GetSysColor(memDCInfo.colorIndex);
-                if (buttonFace != black) {
-                    ConditionalFillRect(lpPaint->hdc, lpPaint->rcPaint, black, buttonFace, memDCInfo.colorIndex, /*useFloodFill*/true);
-                }
+            PixelSurface paintSurface;
+            bool hasPaintSurface = GetSubSurface(backBufferSurface, lpPaint->rcPaint, &paintSurface);
+            if (hasPaintSurface)
+                AddPaintStatistic(&PaintStatistics::pixelsProcessed, (uint64_t)paintSurface.width * paintSurface.height);
+
+            std::vector<uint32_t> capturedBeforeRuns;
+            bool capturePaint = hasPaintSurface && IsPaintCaptureEnabled();
+            if (capturePaint)
+                RunLengthEncodePixels(paintSurface, &capturedBeforeRuns);
+
+            if (hasPaintSurface && g_paintReuseEnabled.load(std::memory_order_relaxed))
+                FixBackgroundRectWithPaintReuse(memDCInfo, backBufferSurface, lpPaint->rcPaint);
+            else
+                FixBackgroundRect(memDCInfo, backBufferSurface, lpPaint->rcPaint);
+
+            if (capturePaint) {
+                std::vector<uint32_t> capturedAfterRuns;
+                RunLengthEncodePixels(paintSurface, &capturedAfterRuns);
+                AppendPaintCaptureRecord(hWnd, lpPaint->rcPaint, memDCInfo.colorIndex, paintSurface, capturedBeforeRuns, capturedAfterRuns);
             }
 
 
@@ -628,10 +3079,7 @@ BOOL WINAPI EndPaintHook(
                 Wh_Log(L"BitBlt failed");
 
             //clean up
-            SelectObject(memDC, memDCInfo.oldBitmap);
-            DeleteObject(memDCInfo.memBitmap);
-
-            DeleteDC(memDC);
+            ReleaseBackBuffer(memDCInfo.hWnd, memDCInfo.backBuffer);
 
 
             SetLastError(originalError);    //Reset the error code so that the hooked API does not appear to have errored in case any helper code above caused an error code to be set. Some Windows API-s do not reset error code in case of success, so lets ensure that we enter the hooked API with original error code.
@@ -639,13 +3087,35 @@ BOOL WINAPI EndPaintHook(
             //pass original HDC to original EndPaint
             PAINTSTRUCT paintStruct = *lpPaint;
             paintStruct.hdc = hdc;
+            timingScope.Stop();
             return pOriginalEndPaint(hWnd, &paintStruct);
         }
     }
     
+    timingScope.Stop();
     return pOriginalEndPaint(hWnd, lpPaint);
 }
 
+//Records the button background rect for EndPaintHook, if the hdc is a back buffer of an ongoing paint
+void RecordFrameControlRect(HDC hdc, const RECT& fillRect) {
+
+    MemDCInfo* memDCInfo = FindPaintInFlight(hdc);
+    if (!memDCInfo)    //button is drawn to some other DC, for example an intermediate buffer
+        return;
+
+    RECT deviceRect = fillRect;
+    if (!LPtoDP(hdc, (POINT*)&deviceRect, 2)) {    //the back buffer pixels are addressed in device coordinates
+        Wh_Log(L"LPtoDP failed");
+        memDCInfo->frameControlRectsOverflow = true;    //the layout is not fully known anymore
+        return;
+    }
+
+    if (memDCInfo->frameControlRectCount >= maxRecordedFrameControlRects)
+        memDCInfo->frameControlRectsOverflow = true;
+    else
+        memDCInfo->frameControlRects[memDCInfo->frameControlRectCount++] = deviceRect;
+}
+
 //this hook is needed in case the buttons are offset in their hdc so that there are spaces in between buttons and some background appears between buttons
 BOOL WINAPI DrawFrameControlHook(
     IN HDC    hdc,
@@ -653,6 +3123,8 @@ BOOL WINAPI DrawFrameControlHook(
     IN UINT   uType,
     IN UINT   uState
 ) {
+    HookTimingScope timingScope(HookTimingId::drawFrameControl);
+
     int colorIndex = COLOR_3DFACE;
     if (
         g_hwndTaskbar   //is the current process the taskbar process?
@@ -725,6 +3197,8 @@ BOOL WINAPI DrawFrameControlHook(
                 }
 
                 FillRect(hdc, &fillRect, brush);
+
+                RecordFrameControlRect(hdc, fillRect);
             }
         }
 
@@ -732,6 +3206,7 @@ BOOL WINAPI DrawFrameControlHook(
         SetLastError(originalError);    //Reset the error code so that the hooked API does not appear to have errored in case any helper code above caused an error code to be set. Some Windows API-s do not reset error code in case of success, so lets ensure that we enter the hooked API with original error code.
     }
 
+    timingScope.Stop();
     return pOriginalDrawFrameControl(
         hdc,
         lprc,
@@ -743,6 +3218,8 @@ BOOL WINAPI DrawFrameControlHook(
 //this hook currently fixes regions near tray area
 bool DrawThemeParentBackgroundInternal(HWND hwnd, HDC hdc) {
 
+    HookTimingScope timingScope(HookTimingId::drawThemeParentBackground);
+
     int originalError = GetLastError();
 
 
@@ -758,13 +3235,12 @@ bool DrawThemeParentBackgroundInternal(HWND hwnd, HDC hdc) {
     ) {
         if (colorIndex == blackColorIndex) {  //Repaint the area as black again. Used for "show desktop" button if the mod settings say so.
 
-            HBRUSH brush = CreateSolidBrush(black);
+            HBRUSH brush = (HBRUSH)GetStockObject(BLACK_BRUSH);      //stock objects are shared and do not need to be created or deleted
             if (!brush) {
-                Wh_Log(L"CreateSolidBrush failed");
+                Wh_Log(L"GetStockObject failed");
             }
             else {
                 FillRect(hdc, &rect, brush);
-                DeleteObject(brush);
 
                 SetLastError(originalError);    //reset the error code so that the hooked API does not appear to have errored in case any helper code above caused an error code to be set
                 return true;
@@ -827,11 +3303,65 @@ HRESULT WINAPI DrawThemeParentBackgroundExHook(
 }
 
 
-void TriggerTaskbarRepaint() {
+inline uint32_t TaskbarWindowClassFlag(TaskbarWindowClass windowClass) {
+    return 1u << (int)windowClass;
+}
+
+const uint32_t allTaskbarWindowClassFlags = UINT32_MAX;
+
+BOOL CALLBACK RepaintTaskbarChildWindowProc(HWND hWnd, LPARAM lParam) {
+
+    uint32_t windowClassFlags = (uint32_t)lParam;
+
+    TaskbarWindowClass windowClass;
+    if (
+        GetTaskbarWindowClass(&windowClass, hWnd)
+        && (windowClassFlags & TaskbarWindowClassFlag(windowClass)) != 0
+    ) {
+        RedrawWindow(hWnd, NULL, NULL, RDW_INVALIDATE | RDW_ALLCHILDREN);
+    }
+
+    return TRUE;    //continue enumeration
+}
+
+BOOL CALLBACK RepaintTaskbarWindowProc(HWND hWnd, LPARAM lParam) {
+
+    uint32_t windowClassFlags = (uint32_t)lParam;
+
+    DWORD processId;
+    TaskbarWindowClass windowClass;
+    if (
+        GetWindowThreadProcessId(hWnd, &processId)
+        && processId == GetCurrentProcessId()
+        && GetTaskbarWindowClass(&windowClass, hWnd)
+        && (
+            windowClass == TaskbarWindowClass::shellTrayWnd
+            || windowClass == TaskbarWindowClass::shellSecondaryTrayWnd
+        )
+    ) {
+        if (windowClassFlags == allTaskbarWindowClassFlags) {
+            RedrawWindow(hWnd, NULL, NULL, RDW_INVALIDATE | RDW_ALLCHILDREN);
+        }
+        else {
+            if ((windowClassFlags & TaskbarWindowClassFlag(windowClass)) != 0)
+                RedrawWindow(hWnd, NULL, NULL, RDW_INVALIDATE);
+
+            EnumChildWindows(hWnd, RepaintTaskbarChildWindowProc, lParam);    //enumerates all descendants
+        }
+    }
+
+    return TRUE;    //continue enumeration
+}
 
-    HWND hwndTaskbar = g_hwndTaskbar;
-    if (hwndTaskbar)
-        RedrawWindow(hwndTaskbar, NULL, NULL, RDW_INVALIDATE | RDW_ALLCHILDREN);
+//Repaints the windows of the given classes on the primary and secondary taskbars
+void RepaintTaskbarWindows(uint32_t windowClassFlags) {
+
+    if (g_hwndTaskbar && windowClassFlags != 0)
+        EnumWindows(RepaintTaskbarWindowProc, (LPARAM)windowClassFlags);
+}
+
+void TriggerTaskbarRepaint() {
+    RepaintTaskbarWindows(allTaskbarWindowClassFlags);
 }
 
 bool TryInit(bool* abort, bool canTriggerRepaint) {
@@ -856,6 +3386,7 @@ bool TryInit(bool* abort, bool canTriggerRepaint) {
         return false;
     }
     else {
+        FlushWindowClassAtomMap();
         g_hwndTaskbar = hwndTaskbar;
     }
 
@@ -870,30 +3401,108 @@ bool TryInit(bool* abort, bool canTriggerRepaint) {
     return true;
 }
 
+//Set by TaskbarCreationWinEventProc. The WinEvent hook is out of context, so the callback runs on the init thread while it waits in WaitForTaskbarCreation().
+bool g_taskbarCreationEventReceived = false;
+
+void CALLBACK TaskbarCreationWinEventProc(
+    HWINEVENTHOOK hWinEventHook,
+    DWORD         event,
+    HWND          hWnd,
+    LONG          idObject,
+    LONG          idChild,
+    DWORD         idEventThread,
+    DWORD         dwmsEventTime
+) {
+    if (idObject != OBJID_WINDOW || idChild != CHILDID_SELF || !hWnd)
+        return;
+
+    WCHAR szClassName[32];
+    if (
+        GetClassNameW(hWnd, szClassName, ARRAYSIZE(szClassName))
+        && _wcsicmp(szClassName, L"Shell_TrayWnd") == 0
+    ) {
+        g_taskbarCreationEventReceived = true;
+    }
+}
+
+//Waits until the taskbar window is created or the timeout elapses. Returns false if the stop signal was set or the wait failed.
+bool WaitForTaskbarCreation(DWORD timeoutMs) {
+
+    ULONGLONG startTime = GetTickCount64();
+
+    while (!g_taskbarCreationEventReceived) {
+
+        ULONGLONG elapsedMs = GetTickCount64() - startTime;
+        if (elapsedMs >= timeoutMs)
+            break;
+
+        DWORD waitResult = MsgWaitForMultipleObjects(1, &g_initThreadStopSignal, FALSE, (DWORD)(timeoutMs - elapsedMs), QS_ALLINPUT);
+        if (waitResult == WAIT_OBJECT_0 + 1) {     //dispatch the WinEvent callbacks
+
+            MSG msg;
+            while (PeekMessageW(&msg, NULL, 0, 0, PM_REMOVE)) {
+                TranslateMessage(&msg);
+                DispatchMessageW(&msg);
+            }
+        }
+        else if (waitResult != WAIT_TIMEOUT) {
+            return false;
+        }
+    }
+
+    g_taskbarCreationEventReceived = false;
+    return true;
+}
+
 DWORD WINAPI InitThreadFunc(LPVOID param) {
 
     Wh_Log(L"InitThreadFunc enter");
 
+    ULONGLONG initStartTime = GetTickCount64();
+
+    //Get notified when the taskbar window is created, so that it can be initialised without waiting for the next poll. The polling remains as a fallback in case the notification is missed or the hook cannot be set.
+    HWINEVENTHOOK winEventHook = SetWinEventHook(
+        EVENT_OBJECT_CREATE,
+        EVENT_OBJECT_CREATE,
+        NULL,
+        TaskbarCreationWinEventProc,
+        GetCurrentProcessId(),
+        0,      //all threads
+        WINEVENT_OUTOFCONTEXT
+    );
+    if (!winEventHook)
+        Wh_Log(L"SetWinEventHook failed, polling for the taskbar only");
+
+    DWORD result;
+    bool abort;
     bool isRetry = false;
 retry:  //wait until taskbar has properly initialised in order to detect whether current process will become taskbar or not
     if (isRetry) {
-        if (WaitForSingleObject(g_initThreadStopSignal, 1000) != WAIT_TIMEOUT) {
+        if (!WaitForTaskbarCreation(1000)) {
             Wh_Log(L"Shutting down InitThreadFunc before success");
-            return FALSE;
+            result = FALSE;
+            goto done;
         }
     }
     isRetry = true;
 
-    bool abort = false;
+    abort = false;
     if (TryInit(&abort, /*canTriggerRepaint*/true)) {
-        return TRUE;  //hooks done
+        Wh_Log(L"Taskbar initialised %llu ms after InitThreadFunc start", (unsigned long long)(GetTickCount64() - initStartTime));
+        result = TRUE;  //hooks done
     }
     else if (abort) {
-        return FALSE;   //if the taskbar process is already running then subsequent non-taskbar related explorer.exe instances will not be hooked
+        result = FALSE;   //if the taskbar process is already running then subsequent non-taskbar related explorer.exe instances will not be hooked
     }
     else {      //taskbar was not yet found, so we need to retry later
         goto retry;
     }
+
+done:
+    if (winEventHook)
+        UnhookWinEvent(winEventHook);
+
+    return result;
 }
 
 void Wh_ModAfterInit(void) {
@@ -919,6 +3528,71 @@ void Wh_ModAfterInit(void) {
     }
 }
 
+//The settings which affect the taskbar appearance
+typedef struct tagAppearanceSettings {
+    RepaintDesktopButtonConfig repaintDesktopButtonConfig;
+    CompatWithTaskbarButtonsModsConfig compatWithTaskbarButtonsModsConfig;
+    BackgroundFixMethod taskListBackgroundFixMethod;
+    BackgroundFixMethod startBackgroundFixMethod;
+    BackgroundFixMethod taskbarBackgroundFixMethod;
+    ColorMappingRuleConfig colorMappingRules[maxColorMappingRules];
+    size_t colorMappingRuleCount;
+    size_t backBufferCacheBudget;       //the windows over the budget are painted without the background fix
+} AppearanceSettings;
+
+void GetAppearanceSettings(OUT AppearanceSettings* settings) {
+
+    settings->repaintDesktopButtonConfig = g_repaintDesktopButtonConfig;
+    settings->compatWithTaskbarButtonsModsConfig = g_compatWithTaskbarButtonsModsConfig;
+    settings->taskListBackgroundFixMethod = g_taskListBackgroundFixMethod;
+    settings->startBackgroundFixMethod = g_startBackgroundFixMethod;
+    settings->taskbarBackgroundFixMethod = g_taskbarBackgroundFixMethod;
+
+    {
+        std::lock_guard<std::mutex> guard(g_backBufferCacheMutex);
+        settings->backBufferCacheBudget = g_backBufferCacheBudget;
+    }
+
+    std::lock_guard<std::mutex> guard(g_colorMappingRulesMutex);
+    settings->colorMappingRuleCount = g_colorMappingRuleCount;
+    memcpy(settings->colorMappingRules, g_colorMappingRules, g_colorMappingRuleCount * sizeof(ColorMappingRuleConfig));
+}
+
+//Returns the flags of the window classes which need to be repainted after the settings change
+uint32_t GetWindowClassesAffectedBySettingsChange(const AppearanceSettings& oldSettings, const AppearanceSettings& newSettings) {
+
+    uint32_t windowClassFlags = 0;
+
+    if (
+        oldSettings.colorMappingRuleCount != newSettings.colorMappingRuleCount
+        || memcmp(oldSettings.colorMappingRules, newSettings.colorMappingRules, newSettings.colorMappingRuleCount * sizeof(ColorMappingRuleConfig)) != 0
+    ) {
+        return allTaskbarWindowClassFlags;     //the rules apply to all repainted areas
+    }
+
+    if (oldSettings.backBufferCacheBudget != newSettings.backBufferCacheBudget)
+        return allTaskbarWindowClassFlags;     //the windows which were painted without the background fix due to the budget, or which will be now, may be any of the repainted windows
+
+    if (oldSettings.repaintDesktopButtonConfig != newSettings.repaintDesktopButtonConfig)
+        windowClassFlags |= TaskbarWindowClassFlag(TaskbarWindowClass::showDesktopButton);
+
+    if (oldSettings.compatWithTaskbarButtonsModsConfig != newSettings.compatWithTaskbarButtonsModsConfig)
+        windowClassFlags |= TaskbarWindowClassFlag(TaskbarWindowClass::taskList);      //affects the button backgrounds drawn by DrawFrameControlHook
+
+    if (oldSettings.taskListBackgroundFixMethod != newSettings.taskListBackgroundFixMethod)
+        windowClassFlags |= TaskbarWindowClassFlag(TaskbarWindowClass::taskList);
+
+    if (oldSettings.startBackgroundFixMethod != newSettings.startBackgroundFixMethod)
+        windowClassFlags |= TaskbarWindowClassFlag(TaskbarWindowClass::start);
+
+    if (oldSettings.taskbarBackgroundFixMethod != newSettings.taskbarBackgroundFixMethod) {
+        windowClassFlags |= TaskbarWindowClassFlag(TaskbarWindowClass::shellTrayWnd);
+        windowClassFlags |= TaskbarWindowClassFlag(TaskbarWindowClass::shellSecondaryTrayWnd);
+    }
+
+    return windowClassFlags;
+}
+
 void LoadSettings() {
 
     PCWSTR configString;
@@ -931,14 +3605,96 @@ void LoadSettings() {
     configString = Wh_GetStringSetting(L"CompatWithTaskbarButtonsMods");
     g_compatWithTaskbarButtonsModsConfig = CompatWithTaskbarButtonsModsConfigFromString(configString);
     Wh_FreeStringSetting(configString);
+
+    configString = Wh_GetStringSetting(L"BackgroundFixMethod.TaskList");
+    g_taskListBackgroundFixMethod = BackgroundFixMethodFromString(configString);
+    Wh_FreeStringSetting(configString);
+
+    configString = Wh_GetStringSetting(L"BackgroundFixMethod.Start");
+    g_startBackgroundFixMethod = BackgroundFixMethodFromString(configString);
+    Wh_FreeStringSetting(configString);
+
+    configString = Wh_GetStringSetting(L"BackgroundFixMethod.Taskbar");
+    g_taskbarBackgroundFixMethod = BackgroundFixMethodFromString(configString);
+    Wh_FreeStringSetting(configString);
+
+    ColorMappingRuleConfig colorMappingRules[maxColorMappingRules];
+    size_t colorMappingRuleCount = 0;
+    for (size_t i = 0; i < maxColorMappingRules; i++) {
+
+        configString = Wh_GetStringSetting(L"ColorMappingRules[%d].Color", (int)i);
+        PCWSTR hexString = configString;
+        if (hexString[0] == L'#')
+            hexString++;
+
+        WCHAR* end;
+        unsigned long color = wcstoul(hexString, &end, 16);
+        bool isValidColor = hexString[0] && !*end && color <= 0xFFFFFF;
+        if (hexString[0] && !isValidColor)
+            Wh_Log(L"Invalid colour in colour mapping rule %u: %ls", (unsigned int)i, configString);
+
+        Wh_FreeStringSetting(configString);
+
+        if (!isValidColor)
+            continue;   //empty or invalid rule
+
+        ColorMappingRuleConfig& rule = colorMappingRules[colorMappingRuleCount++];
+        rule.pixel = (uint32_t)color;      //RRGGBB format matches the DIB pixel format
+        rule.tolerance = (uint32_t)min(max(Wh_GetIntSetting(L"ColorMappingRules[%d].Tolerance", (int)i), 0), 255);
+
+        configString = Wh_GetStringSetting(L"ColorMappingRules[%d].ReplacementColor", (int)i);
+        rule.colorIndex = ReplacementColorIndexFromString(configString);
+        Wh_FreeStringSetting(configString);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(g_colorMappingRulesMutex);
+        memcpy(g_colorMappingRules, colorMappingRules, colorMappingRuleCount * sizeof(ColorMappingRuleConfig));
+        g_colorMappingRuleCount = colorMappingRuleCount;
+    }
+
+    configString = Wh_GetStringSetting(L"PaintCaptureFile");
+    if (configString[0]) {
+        int paintCaptureMaxSizeMB = max(Wh_GetIntSetting(L"PaintCaptureMaxSize"), 1);
+        OpenPaintCaptureFile(configString, (uint64_t)paintCaptureMaxSizeMB * 1024 * 1024);
+    }
+    else {
+        ClosePaintCaptureFile();
+    }
+    Wh_FreeStringSetting(configString);
+
+    EnablePaintStatistics(Wh_GetIntSetting(L"PaintStatistics") != 0);
+
+    g_parallelPixelProcessingEnabled.store(Wh_GetIntSetting(L"ParallelPixelProcessing") != 0);
+
+    {
+        std::lock_guard<std::mutex> guard(g_paintReuseCacheMutex);
+        g_paintReuseEnabled.store(Wh_GetIntSetting(L"ReuseUnchangedPaints") != 0);
+    }
+
+    int backBufferCacheBudgetMB = Wh_GetIntSetting(L"BackBufferCacheBudget");
+    {
+        std::lock_guard<std::mutex> guard(g_backBufferCacheMutex);
+        g_backBufferCacheBudget = (size_t)max(backBufferCacheBudgetMB, 0) * 1024 * 1024;
+    }
 }
 
 BOOL Wh_ModInit() {
 
+    LARGE_INTEGER performanceFrequency;
+    QueryPerformanceFrequency(&performanceFrequency);      //always succeeds on Windows XP and later
+    g_performanceFrequency = performanceFrequency.QuadPart;
+
     LoadSettings();
 
     Wh_Log(L"Init");
 
+    InitPixelKernels();
+
+    g_unsubclassShowDesktopButtonMessage = RegisterWindowMessageW(L"Windhawk_classic-taskbar-background-fix_Unsubclass");
+    if (!g_unsubclassShowDesktopButtonMessage)
+        Wh_Log(L"RegisterWindowMessageW failed, show desktop button hover state will be checked during each paint");
+
 
     HMODULE hUser32 = GetModuleHandleW(L"user32.dll");
     if (!hUser32) {
@@ -1030,6 +3786,8 @@ BOOL Wh_ModInit() {
     Wh_SetFunctionHookT(pDrawThemeParentBackground, DrawThemeParentBackgroundHook, &pOriginalDrawThemeParentBackground);
     Wh_SetFunctionHookT(pDrawThemeParentBackgroundEx, DrawThemeParentBackgroundExHook, &pOriginalDrawThemeParentBackgroundEx);
 
+    RegisterDllNotification();
+
     return TRUE;
 }
 
@@ -1037,10 +3795,21 @@ void Wh_ModSettingsChanged() {
 
     Wh_Log(L"Wh_ModSettingsChanged");
 
+    AppearanceSettings oldSettings;
+    GetAppearanceSettings(&oldSettings);
+
     LoadSettings();
 
-    //apply the updated colour immediately
-    TriggerTaskbarRepaint();
+    AppearanceSettings newSettings;
+    GetAppearanceSettings(&newSettings);
+
+    FlushBackBufferCache();     //the budget may have been decreased
+    FlushBackgroundMaskCache();
+    FlushPaintReuseCache();
+    FlushWindowClassAtomMap();
+
+    //apply the updated settings immediately, repainting only the windows affected by the change
+    RepaintTaskbarWindows(GetWindowClassesAffectedBySettingsChange(oldSettings, newSettings));
 }
 
 void Wh_ModUninit() {
@@ -1080,6 +3849,21 @@ void Wh_ModUninit() {
     }
 
 
+    UnregisterDllNotification();
+
+    UnsubclassShowDesktopButtons();
+
+    StopPixelWorkerThreads();
+
+    FlushBackBufferCache();
+    FlushMemDCPool();
+    FlushBackgroundMaskCache();
+    FlushPaintReuseCache();
+    FreePaintsInFlightAllocations();
+    ClosePaintCaptureFile();
+    ClosePaintStatistics();
+
+
     //apply the default colour immediately
     TriggerTaskbarRepaint();
 
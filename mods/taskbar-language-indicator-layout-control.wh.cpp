@@ -2,7 +2,7 @@
 // @id              taskbar-language-indicator-layout-control
 // @name            Taskbar language indicator layout control
 // @description     Prevents the Tray area from jumping around when the language indicator is hidden while RDP client window is active. There are multiple mitigations you can choose from.
-// @version         1.0
+// @version         1.1
 // @author          Roland Pihlakas
 // @github          https://github.com/levitation
 // @homepage        https://www.simplify.ee/
@@ -391,6 +391,11 @@ bool TryInit(bool* abort) {
         *abort = true;
         return false;
     }
+    else if (!FindWindowExW(hwndTaskbar, NULL, L"TrayNotifyWnd", NULL)) {
+        //The tray area is created after the taskbar window. The hide or show settings force a relayout of the tray, which would be lost if the tray does not exist yet.
+        Wh_Log(L"Tray area not yet created");
+        return false;   //retry
+    }
     else {
         g_hwndTaskbar = hwndTaskbar;
 
@@ -402,30 +407,108 @@ bool TryInit(bool* abort) {
     }
 }
 
+//Set by TaskbarCreationWinEventProc. The WinEvent hook is out of context, so the callback runs on the init thread while it waits in WaitForTaskbarCreation().
+bool g_taskbarCreationEventReceived = false;
+
+void CALLBACK TaskbarCreationWinEventProc(
+    HWINEVENTHOOK hWinEventHook,
+    DWORD         event,
+    HWND          hWnd,
+    LONG          idObject,
+    LONG          idChild,
+    DWORD         idEventThread,
+    DWORD         dwmsEventTime
+) {
+    if (idObject != OBJID_WINDOW || idChild != CHILDID_SELF || !hWnd)
+        return;
+
+    WCHAR szClassName[32];
+    if (
+        GetClassNameW(hWnd, szClassName, ARRAYSIZE(szClassName))
+        && _wcsicmp(szClassName, L"TrayNotifyWnd") == 0     //the tray area is created after the taskbar window itself, and TryInit() needs both
+    ) {
+        g_taskbarCreationEventReceived = true;
+    }
+}
+
+//Waits until the tray area of the taskbar is created or the timeout elapses. Returns false if the stop signal was set or the wait failed.
+bool WaitForTaskbarCreation(DWORD timeoutMs) {
+
+    ULONGLONG startTime = GetTickCount64();
+
+    while (!g_taskbarCreationEventReceived) {
+
+        ULONGLONG elapsedMs = GetTickCount64() - startTime;
+        if (elapsedMs >= timeoutMs)
+            break;
+
+        DWORD waitResult = MsgWaitForMultipleObjects(1, &g_initThreadStopSignal, FALSE, (DWORD)(timeoutMs - elapsedMs), QS_ALLINPUT);
+        if (waitResult == WAIT_OBJECT_0 + 1) {     //dispatch the WinEvent callbacks
+
+            MSG msg;
+            while (PeekMessageW(&msg, NULL, 0, 0, PM_REMOVE)) {
+                TranslateMessage(&msg);
+                DispatchMessageW(&msg);
+            }
+        }
+        else if (waitResult != WAIT_TIMEOUT) {
+            return false;
+        }
+    }
+
+    g_taskbarCreationEventReceived = false;
+    return true;
+}
+
 DWORD WINAPI InitThreadFunc(LPVOID param) {
 
     Wh_Log(L"InitThreadFunc enter");
 
+    ULONGLONG initStartTime = GetTickCount64();
+
+    //Get notified when the tray area of the taskbar is created, so that it can be initialised without waiting for the next poll. The polling remains as a fallback in case the notification is missed or the hook cannot be set.
+    HWINEVENTHOOK winEventHook = SetWinEventHook(
+        EVENT_OBJECT_CREATE,
+        EVENT_OBJECT_CREATE,
+        NULL,
+        TaskbarCreationWinEventProc,
+        GetCurrentProcessId(),
+        0,      //all threads
+        WINEVENT_OUTOFCONTEXT
+    );
+    if (!winEventHook)
+        Wh_Log(L"SetWinEventHook failed, polling for the taskbar only");
+
+    DWORD result;
+    bool abort;
     bool isRetry = false;
 retry:  //wait until taskbar has properly initialised in order to detect whether current process will become taskbar or not
     if (isRetry) {
-        if (WaitForSingleObject(g_initThreadStopSignal, 1000) != WAIT_TIMEOUT) {
+        if (!WaitForTaskbarCreation(1000)) {
             Wh_Log(L"Shutting down InitThreadFunc before success");
-            return FALSE;
+            result = FALSE;
+            goto done;
         }
     }
     isRetry = true;
 
-    bool abort = false;
+    abort = false;
     if (TryInit(&abort)) {
-        return TRUE;
+        Wh_Log(L"Taskbar initialised %llu ms after InitThreadFunc start", (unsigned long long)(GetTickCount64() - initStartTime));
+        result = TRUE;
     }
     else if (abort) {
-        return FALSE;   //if the taskbar process is already running then subsequent non-taskbar related explorer.exe instances will not be hooked
+        result = FALSE;   //if the taskbar process is already running then subsequent non-taskbar related explorer.exe instances will not be hooked
     }
     else {      //taskbar was not yet found, so we need to retry later
         goto retry;
     }
+
+done:
+    if (winEventHook)
+        UnhookWinEvent(winEventHook);
+
+    return result;
 }
 
 void Wh_ModAfterInit(void) {
@@ -2,11 +2,11 @@
 // @id              tortoisegit-progress-animation-background-fix
 // @name            TortoiseGit progress animation background fix for classic dark theme
 // @description     Fixes progress animation background in classic dark theme by replacing white background with a classic button face colour
-// @version         1.0.0
+// @version         1.1.0
 // @author          Roland Pihlakas
 // @github          https://github.com/levitation
 // @homepage        https://www.simplify.ee/
-// @compilerOptions -lgdi32
+// @compilerOptions -lgdi32 -luser32
 // @include         TortoiseGitProc.exe
 // ==/WindhawkMod==
 
@@ -44,7 +44,12 @@ There is still a brief flash of a white coloured box before the progress animati
 
 #include <windowsx.h>
 #include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <new>          //std::nothrow
+#include <vector>
 
 
 #ifndef WH_MOD
@@ -68,12 +73,56 @@ const COLORREF white = RGB(255, 255, 255);
 
 std::atomic<size_t> g_hookRefCount;
 
+//Verdicts of ControlNeedsBackgroundRepaint() per window. Each slot packs the window handle, the window's thread id, the verdict and a valid flag into one atomic value, so that the lookups in BitBltHook do not need a lock. Colliding windows just overwrite each other.
+//A cached verdict is used only if the window still exists and still belongs to the same thread, so that a reused window handle does not get a stale verdict.
+const size_t windowVerdictCacheSize = 64;     //must be a power of two
+const uint64_t windowVerdictValidFlag = 1;
+const uint64_t windowVerdictResultFlag = 2;
+const uint64_t windowVerdictThreadIdMask = 0xFFFFFFFC;     //thread ids are multiples of 4, so the low bits are free for the flags
+const int windowVerdictHandleShift = 32;      //window handles fit into 32 bits
+
+std::atomic<uint64_t> g_windowVerdictCache[windowVerdictCacheSize];
+
+//The animation loops over a small set of frames, so the recoloured frames are cached by the hash of their original pixels
+typedef struct tagCachedFrame {
+    int width;
+    int height;
+    bool modified;                  //false if the fix did not change anything, then the pixels are not stored
+    std::shared_ptr<const std::vector<uint32_t>> pixels;   //the recoloured frame in 32bpp top-down DIB format. Shared so that the frame can be drawn without holding the cache lock.
+    uint64_t lastUse;
+} CachedFrame;
+
+const size_t frameCacheMaxEntries = 32;
+const size_t frameCacheMaxPixelsPerFrame = 128 * 1024;     //larger frames are not cached
+
+std::mutex g_frameCacheMutex;      //held only for the lookups and inserts, not during the GDI calls
+std::map<uint64_t, CachedFrame> g_frameCache;
+COLORREF g_frameCacheNewColor = CLR_INVALID;      //the replacement colour of the cached frames
+uint64_t g_frameCacheUseCounter = 0;
+size_t g_frameCacheLookupCount = 0;
+size_t g_frameCacheHitCount = 0;
+
+//32bpp top-down DIB section which receives the copy of the blitted pixels. The bitmaps are pooled and reused across the blits, so that a frame cache hit does not need to create any GDI objects. Each blit checks out its own bitmap, so that the animations of different threads do not wait for each other.
+typedef struct tagScratchBitmap {
+    HDC dc;
+    HBITMAP bitmap;
+    HGDIOBJ oldBitmap;
+    uint32_t* pixels;
+    int width;      //also the stride of pixels
+    int height;
+} ScratchBitmap;
+
+const size_t scratchBitmapPoolMaxEntries = 4;
+
+std::mutex g_scratchBitmapPoolMutex;
+std::vector<ScratchBitmap*> g_scratchBitmapPool;
+
 
 using BitBlt_t = decltype(&BitBlt);
 BitBlt_t pOriginalBitBlt;
 
 
-bool ControlNeedsBackgroundRepaint(HWND hWnd) {
+bool IsAnimationControl(HWND hWnd) {
 
     WCHAR szClassName[32];
     if (
@@ -88,120 +137,473 @@ bool ControlNeedsBackgroundRepaint(HWND hWnd) {
     }
 }
 
-void ConditionalFillRect(HDC hdc, const RECT& rect, COLORREF oldColor, COLORREF newColor, int newColorIndex, bool useFloodFill) {
+size_t GetWindowVerdictCacheSlot(HWND hWnd) {
+    return (size_t)(((uint64_t)(uintptr_t)hWnd * 0x9E3779B97F4A7C15ull) >> 32) & (windowVerdictCacheSize - 1);
+}
 
-    int pixelCount = (rect.right - rect.left) * (rect.bottom - rect.top);
-    if (pixelCount == 0) {
-        //Wh_Log(L"pixelCount == 0");
-        return;
+uint64_t PackWindowVerdictCacheEntry(HWND hWnd, DWORD threadId, bool needsBackgroundRepaint) {
+    return ((uint64_t)(uint32_t)(uintptr_t)hWnd << windowVerdictHandleShift)
+        | (threadId & windowVerdictThreadIdMask)
+        | (needsBackgroundRepaint ? windowVerdictResultFlag : 0)
+        | windowVerdictValidFlag;
+}
+
+bool ControlNeedsBackgroundRepaint(HWND hWnd) {
+
+    if (!hWnd)
+        return false;
+
+    DWORD threadId = GetWindowThreadProcessId(hWnd, NULL);
+    if (!threadId)      //the window does not exist
+        return false;
+
+    size_t slot = GetWindowVerdictCacheSlot(hWnd);
+    uint64_t entry = g_windowVerdictCache[slot].load(std::memory_order_relaxed);
+    if ((entry & ~windowVerdictResultFlag) == PackWindowVerdictCacheEntry(hWnd, threadId, false))
+        return (entry & windowVerdictResultFlag) != 0;
+
+    bool result = IsAnimationControl(hWnd);
+
+    g_windowVerdictCache[slot].store(PackWindowVerdictCacheEntry(hWnd, threadId, result), std::memory_order_relaxed);
+
+    return result;
+}
+
+//Note that the pixel values in 32bpp DIB-s are in 0x00RRGGBB format, while COLORREF is in 0x00BBGGRR format. Use ColorRefToDibPixel() for converting the colours. The alpha byte is ignored during comparisons since GDI does not maintain it consistently.
+
+const uint32_t dibPixelColorMask = 0x00FFFFFF;
+
+inline uint32_t ColorRefToDibPixel(COLORREF color) {
+    return (uint32_t)((GetRValue(color) << 16) | (GetGValue(color) << 8) | GetBValue(color));
+}
+
+struct FloodFillSeed {
+    int x;
+    int y;
+};
+
+//Span based (scanline) flood fill working directly on a 32bpp top-down pixel buffer. Has the same semantics as ExtFloodFill with FLOODFILLSURFACE: fills the 4-connected area of surfacePixel colour containing the seed pixel. Stride is in pixels.
+//Returns false if the seed is outside of the buffer or does not have the surface colour, in which case ExtFloodFill would fail as well.
+bool FloodFillSurface(uint32_t* pixels, int width, int height, ptrdiff_t stride, int seedX, int seedY, uint32_t surfacePixel, uint32_t fillPixel) {
+
+    if (
+        seedX < 0 || seedX >= width
+        || seedY < 0 || seedY >= height
+        || (pixels[seedY * stride + seedX] & dibPixelColorMask) != surfacePixel
+    ) {
+        return false;
+    }
+
+    if ((fillPixel & dibPixelColorMask) == surfacePixel)    //nothing would change visually, and the fill would never terminate since filled pixels would still look like surface pixels
+        return true;
+
+    size_t stackCapacity = 64;
+    size_t stackSize = 0;
+    FloodFillSeed* stack = new(std::nothrow) FloodFillSeed[stackCapacity];
+    if (!stack) {
+        Wh_Log(L"Allocating flood fill stack failed");
+        return false;
+    }
+
+    stack[stackSize++] = { seedX, seedY };
+
+    bool result = true;
+    while (stackSize > 0) {
+
+        FloodFillSeed seed = stack[--stackSize];
+        uint32_t* row = pixels + seed.y * stride;
+        if ((row[seed.x] & dibPixelColorMask) != surfacePixel)   //already filled via another seed
+            continue;
+
+        //find the whole span of surface colour around the seed and fill it
+        int left = seed.x;
+        while (left > 0 && (row[left - 1] & dibPixelColorMask) == surfacePixel)
+            left--;
+        int right = seed.x;
+        while (right < width - 1 && (row[right + 1] & dibPixelColorMask) == surfacePixel)
+            right++;
+
+        for (int x = left; x <= right; x++)
+            row[x] = fillPixel;
+
+        //push one seed per each run of surface colour in the rows above and below the filled span
+        for (int neighbourY = seed.y - 1; neighbourY <= seed.y + 1; neighbourY += 2) {
+
+            if (neighbourY < 0 || neighbourY >= height)
+                continue;
+
+            uint32_t* neighbourRow = pixels + neighbourY * stride;
+            bool inRun = false;
+            for (int x = left; x <= right; x++) {
+
+                bool isSurface = (neighbourRow[x] & dibPixelColorMask) == surfacePixel;
+                if (isSurface && !inRun) {
+
+                    if (stackSize == stackCapacity) {
+
+                        FloodFillSeed* newStack = new(std::nothrow) FloodFillSeed[stackCapacity * 2];
+                        if (!newStack) {
+                            Wh_Log(L"Growing flood fill stack failed");
+                            result = false;
+                            stackSize = 0;
+                            break;
+                        }
+
+                        memcpy(newStack, stack, stackSize * sizeof(FloodFillSeed));
+                        delete[] stack;
+                        stack = newStack;
+                        stackCapacity *= 2;
+                    }
+
+                    stack[stackSize++] = { x, neighbourY };
+                }
+                inRun = isSurface;
+            }
+
+            if (!result)
+                break;
+        }
+
+        if (!result)
+            break;
+    }
+
+    delete[] stack;
+    return result;
+}
+
+inline uint64_t MixHash(uint64_t hash, uint64_t value) {
+
+    hash ^= value;
+    hash *= 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 29);
+}
+
+//Fast non-cryptographic hash of the pixels. The alpha byte is ignored like in the other pixel comparisons.
+uint64_t HashPixels(const uint32_t* pixels, int width, int height, ptrdiff_t stride) {
+
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (int y = 0; y < height; y++) {
+
+        const uint32_t* row = pixels + y * stride;
+        for (int x = 0; x < width; x++) {
+            hash = ((hash << 5) | (hash >> 59)) ^ (row[x] & dibPixelColorMask);
+            hash *= 0x100000001B3ull;
+        }
+    }
+
+    return MixHash(hash, ((uint64_t)width << 32) | (uint32_t)height);
+}
+
+void DestroyScratchBitmapObjects(ScratchBitmap* scratch) {
+
+    if (scratch->dc) {
+        SelectObject(scratch->dc, scratch->oldBitmap);
+        DeleteDC(scratch->dc);
+        scratch->dc = NULL;
+    }
+
+    if (scratch->bitmap) {
+        DeleteObject(scratch->bitmap);
+        scratch->bitmap = NULL;
+    }
+
+    scratch->oldBitmap = NULL;
+    scratch->pixels = NULL;
+    scratch->width = 0;
+    scratch->height = 0;
+}
+
+bool EnsureScratchBitmap(ScratchBitmap* scratch, HDC hdc, int width, int height) {
+
+    if (
+        scratch->dc
+        && width <= scratch->width
+        && height <= scratch->height
+    ) {
+        return true;
     }
 
-    //Create a compatible DC and bitmap
-    HDC memDC = CreateCompatibleDC(hdc);
-    if (!memDC) {
+    //grow to cover both the earlier and the current sizes, so that the bitmap is not recreated repeatedly when the sizes alternate
+    if (scratch->width > width)
+        width = scratch->width;
+    if (scratch->height > height)
+        height = scratch->height;
+    DestroyScratchBitmapObjects(scratch);
+
+    HDC scratchDC = CreateCompatibleDC(hdc);
+    if (!scratchDC) {
         Wh_Log(L"CreateCompatibleDC failed");
+        return false;
+    }
+
+    BITMAPINFO bmi = {};
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = width;
+    bmi.bmiHeader.biHeight = -height;   //negative height means top-down row order, which matches the coordinates used by the flood fill
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;  //32-bit color depth
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    void* pixels = NULL;
+    HBITMAP scratchBitmap = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, &pixels, NULL, 0);
+    if (!scratchBitmap || !pixels) {
+        Wh_Log(L"CreateDIBSection failed");
+        if (scratchBitmap)
+            DeleteObject(scratchBitmap);
+        DeleteDC(scratchDC);
+        return false;
+    }
+
+    HGDIOBJ oldBitmap = SelectObject(scratchDC, scratchBitmap);
+    if (!oldBitmap) {
+        Wh_Log(L"SelectObject for scratchBitmap failed");
+        DeleteObject(scratchBitmap);
+        DeleteDC(scratchDC);
+        return false;
+    }
+
+    scratch->dc = scratchDC;
+    scratch->bitmap = scratchBitmap;
+    scratch->oldBitmap = oldBitmap;
+    scratch->pixels = (uint32_t*)pixels;
+    scratch->width = width;
+    scratch->height = height;
+    return true;
+}
+
+//Returns NULL if the allocation fails
+ScratchBitmap* CheckOutScratchBitmap() {
+    {
+        std::lock_guard<std::mutex> guard(g_scratchBitmapPoolMutex);
+
+        if (!g_scratchBitmapPool.empty()) {
+            ScratchBitmap* scratch = g_scratchBitmapPool.back();
+            g_scratchBitmapPool.pop_back();
+            return scratch;
+        }
+    }
+
+    ScratchBitmap* scratch = new(std::nothrow) ScratchBitmap();
+    if (!scratch)
+        Wh_Log(L"Allocating scratch bitmap failed");
+    return scratch;
+}
+
+void CheckInScratchBitmap(ScratchBitmap* scratch) {
+    {
+        std::lock_guard<std::mutex> guard(g_scratchBitmapPoolMutex);
+
+        if (g_scratchBitmapPool.size() < scratchBitmapPoolMaxEntries) {
+            g_scratchBitmapPool.push_back(scratch);
+            return;
+        }
+    }
+
+    //the pool is full, free the GDI objects outside of the lock
+    DestroyScratchBitmapObjects(scratch);
+    delete scratch;
+}
+
+void FlushScratchBitmapPool() {
+
+    std::vector<ScratchBitmap*> scratchBitmapPool;
+    {
+        std::lock_guard<std::mutex> guard(g_scratchBitmapPoolMutex);
+        scratchBitmapPool.swap(g_scratchBitmapPool);
+    }
+
+    for (ScratchBitmap* scratch : scratchBitmapPool) {
+        DestroyScratchBitmapObjects(scratch);
+        delete scratch;
+    }
+}
+
+//Called only while holding g_frameCacheMutex
+void StoreCachedFrame(uint64_t key, int width, int height, bool modified, std::shared_ptr<const std::vector<uint32_t>> pixels) {
+
+    if (g_frameCache.size() >= frameCacheMaxEntries) {
+
+        auto lruIt = g_frameCache.begin();
+        for (auto candidateIt = g_frameCache.begin(); candidateIt != g_frameCache.end(); ++candidateIt) {
+            if (candidateIt->second.lastUse < lruIt->second.lastUse)
+                lruIt = candidateIt;
+        }
+        g_frameCache.erase(lruIt);
+    }
+
+    CachedFrame& frame = g_frameCache[key];
+    frame.width = width;
+    frame.height = height;
+    frame.modified = modified;
+    frame.lastUse = ++g_frameCacheUseCounter;
+
+    frame.pixels = std::move(pixels);
+}
+
+void FlushFrameCache() {
+
+    std::lock_guard<std::mutex> guard(g_frameCacheMutex);
+
+    g_frameCache.clear();
+
+    Wh_Log(
+        L"Frame cache statistics: lookups %llu, hits %llu",
+        (unsigned long long)g_frameCacheLookupCount,
+        (unsigned long long)g_frameCacheHitCount
+    );
+}
+
+void ConditionalFillRectWithScratchBitmap(HDC hdc, const RECT& rect, COLORREF oldColor, COLORREF newColor, bool useFloodFill, ScratchBitmap* scratch) {
+
+    int width = rect.right - rect.left;
+    int height = rect.bottom - rect.top;
+
+    //copy the existing content from hdc
+    if (!pOriginalBitBlt(scratch->dc, 0, 0, width, height, hdc, rect.left, rect.top, SRCCOPY)) {
+        Wh_Log(L"BitBlt to scratchDC failed");
         return;
     }
 
-    HBITMAP memBitmap = CreateCompatibleBitmap(hdc, rect.right - rect.left, rect.bottom - rect.top);
-    if (!memBitmap) {
-        Wh_Log(L"CreateCompatibleBitmap failed");
+    GdiFlush();     //make sure that GDI has completed the copy before accessing the pixels directly
+
+    uint32_t* pixels = scratch->pixels;
+    ptrdiff_t stride = scratch->width;
+
+    uint64_t key = MixHash(HashPixels(pixels, width, height, stride), ((uint64_t)oldColor << 1) | (useFloodFill ? 1 : 0));
+
+    bool isCached = false;
+    bool cachedFrameModified = false;
+    std::shared_ptr<const std::vector<uint32_t>> cachedPixels;
+    {
+        std::lock_guard<std::mutex> guard(g_frameCacheMutex);
+
+        if (newColor != g_frameCacheNewColor) {     //the system colours have changed, the cached frames are obsolete
+
+            if (!g_frameCache.empty())
+                Wh_Log(L"Replacement colour changed, flushing frame cache");
+
+            g_frameCache.clear();
+            g_frameCacheNewColor = newColor;
+        }
+
+        g_frameCacheLookupCount++;
+
+        auto it = g_frameCache.find(key);
+        if (
+            it != g_frameCache.end()
+            && it->second.width == width
+            && it->second.height == height
+        ) {
+            g_frameCacheHitCount++;
+
+            CachedFrame& frame = it->second;
+            frame.lastUse = ++g_frameCacheUseCounter;
+
+            isCached = true;
+            cachedFrameModified = frame.modified;
+            cachedPixels = frame.pixels;
+        }
     }
-    else {
-        HGDIOBJ oldBitmap = SelectObject(memDC, memBitmap);
-        if (!oldBitmap) {
-            Wh_Log(L"SelectObject for memBitmap failed");
+
+    if (isCached) {
+
+        if (cachedFrameModified) {
+
+            BITMAPINFO bmi = {};
+            bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+            bmi.bmiHeader.biWidth = width;
+            bmi.bmiHeader.biHeight = -height;   //top-down row order
+            bmi.bmiHeader.biPlanes = 1;
+            bmi.bmiHeader.biBitCount = 32;  //32-bit color depth
+            bmi.bmiHeader.biCompression = BI_RGB;
+
+            //write the cached recoloured frame back to hdc
+            if (!SetDIBitsToDevice(hdc, rect.left, rect.top, width, height, 0, 0, 0, height, cachedPixels->data(), &bmi, DIB_RGB_COLORS))
+                Wh_Log(L"SetDIBitsToDevice failed");
+        }
+
+        return;
+    }
+
+    uint32_t oldPixel = ColorRefToDibPixel(oldColor);
+    uint32_t newPixel = ColorRefToDibPixel(newColor);
+
+    //modify the pixels
+    bool modified;
+    if (useFloodFill) {
+        if ((pixels[0] & dibPixelColorMask) != oldPixel) {     //the top left corner is not background, there is nothing to fill
+            modified = false;
+        }
+        else if (!FloodFillSurface(
+            pixels,
+            width,
+            height,
+            stride,
+            //start from top left corner
+            /*seedX*/0,
+            /*seedY*/0,
+            oldPixel,
+            newPixel
+        )) {
+            //the fill stopped halfway, do not draw or cache the partially filled frame
+            return;
         }
         else {
-            //copy the existing content from hdc
-            if (!pOriginalBitBlt(memDC, 0, 0, rect.right - rect.left, rect.bottom - rect.top, hdc, rect.left, rect.top, SRCCOPY)) {
-                Wh_Log(L"BitBlt to memDC failed");
+            modified = true;
+        }
+    }
+    else {      //use conditional colour replacement on all pixels
+        for (int y = 0; y < height; y++) {
+            uint32_t* row = pixels + y * stride;
+            for (int x = 0; x < width; x++) {
+                if ((row[x] & dibPixelColorMask) == oldPixel)
+                    row[x] = newPixel;
             }
-            else {
-                if (useFloodFill) {
+        }
+        modified = true;
+    }
 
-                    HBRUSH newBrush = GetSysColorBrush(newColorIndex);
-                    if (!newBrush) {
-                        Wh_Log(L"GetSysColorBrush failed - is the colour supported by current OS?");
-                    }
-                    else {
-                        HGDIOBJ oldBrush = SelectObject(memDC, newBrush);
-                        if (!oldBrush) {
-                            Wh_Log(L"SelectObject for newBrush failed");
-                        }
-                        else {
-                            if (!ExtFloodFill(
-                                memDC,
-                                //start from top left corner
-                                0, //left
-                                0, //top
-                                oldColor,
-                                FLOODFILLSURFACE
-                            )) {
-                                //Wh_Log(L"ExtFloodFill failed");
-                            }
-                            else {
-                                //blit the modified content back to hdc
-                                if (!pOriginalBitBlt(hdc, rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top, memDC, 0, 0, SRCCOPY))
-                                    Wh_Log(L"BitBlt to hdc failed");
-                            }
-
-                            SelectObject(memDC, oldBrush);
-                        }
-                    }
-                }
-                else {      //use conditional colour replacement on all pixels
-
-                    //get pixels array from bitmap
-                    BITMAPINFO bmi = {};
-                    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-                    bmi.bmiHeader.biWidth = rect.right - rect.left;
-                    bmi.bmiHeader.biHeight = rect.bottom - rect.top;
-                    bmi.bmiHeader.biPlanes = 1;
-                    bmi.bmiHeader.biBitCount = 32;  //32-bit color depth
-                    bmi.bmiHeader.biCompression = BI_RGB;
-
-                    COLORREF* pixels = new (std::nothrow) COLORREF[pixelCount];
-                    if (!pixels) {
-                        Wh_Log(L"Allocating pixels array failed");
-                    }
-                    else {
-                        int getDIBitsResult = GetDIBits(memDC, memBitmap, 0, rect.bottom - rect.top, pixels, &bmi, DIB_RGB_COLORS);
-                        if (getDIBitsResult == NULL || getDIBitsResult == ERROR_INVALID_PARAMETER) {
-                            Wh_Log(L"GetDIBits failed");
-                            delete[] pixels;
-                        }
-                        else {
-                            //modify the pixels
-                            for (int i = 0; i < pixelCount; ++i) {
-                                if (pixels[i] == oldColor)
-                                    pixels[i] = newColor;
-                            }
-
-                            //save pixels array back to bitmap
-                            int setDIBitsResult = SetDIBits(memDC, memBitmap, 0, rect.bottom - rect.top, pixels, &bmi, DIB_RGB_COLORS);
-                            delete[] pixels;
-
-                            if (setDIBitsResult == NULL || setDIBitsResult == ERROR_INVALID_PARAMETER) {
-                                Wh_Log(L"SetDIBits failed");
-                            }
-                            else {
-                                //blit the modified content back to hdc
-                                if (!pOriginalBitBlt(hdc, rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top, memDC, 0, 0, SRCCOPY))
-                                    Wh_Log(L"BitBlt to hdc failed");
-                            }
-                        }
-                    }
-                }
-            }
+    if (modified) {
+        //blit the modified content back to hdc
+        if (!pOriginalBitBlt(hdc, rect.left, rect.top, width, height, scratch->dc, 0, 0, SRCCOPY))
+            Wh_Log(L"BitBlt to hdc failed");
+    }
 
-            //clean up
-            SelectObject(memDC, oldBitmap);
-            DeleteObject(memBitmap);
-        }
+    if ((size_t)width * height > frameCacheMaxPixelsPerFrame)
+        return;
+
+    //copy the frame outside of the lock
+    std::shared_ptr<std::vector<uint32_t>> framePixels;
+    if (modified) {
+        framePixels = std::make_shared<std::vector<uint32_t>>((size_t)width * height);
+        for (int y = 0; y < height; y++)
+            memcpy(framePixels->data() + (size_t)y * width, pixels + y * stride, width * sizeof(uint32_t));
+    }
+
+    std::lock_guard<std::mutex> guard(g_frameCacheMutex);
 
-        DeleteDC(memDC);
+    if (newColor == g_frameCacheNewColor)     //otherwise the colours changed during the fix
+        StoreCachedFrame(key, width, height, modified, std::move(framePixels));
+}
+
+void ConditionalFillRect(HDC hdc, const RECT& rect, COLORREF oldColor, COLORREF newColor, bool useFloodFill) {
+
+    int width = rect.right - rect.left;
+    int height = rect.bottom - rect.top;
+    if (width <= 0 || height <= 0) {
+        //Wh_Log(L"pixelCount == 0");
+        return;
     }
+
+    ScratchBitmap* scratch = CheckOutScratchBitmap();
+    if (!scratch)
+        return;
+
+    if (EnsureScratchBitmap(scratch, hdc, width, height))
+        ConditionalFillRectWithScratchBitmap(hdc, rect, oldColor, newColor, useFloodFill, scratch);
+
+    CheckInScratchBitmap(scratch);
 }
 
 BOOL WINAPI BitBltHook(
@@ -223,6 +625,7 @@ BOOL WINAPI BitBltHook(
     if (
         hdcSrc
         && hdcDest
+        && GetObjectType(hdcDest) != OBJ_MEMDC      //most blits go to memory DC-s, which do not belong to any window. GetObjectType() does not enter the kernel, unlike WindowFromDC().
     ) {
         HWND hwndDest = WindowFromDC(hdcDest);
 
@@ -242,7 +645,7 @@ BOOL WINAPI BitBltHook(
 
                 COLORREF buttonFace = GetSysColor(colorIndex);
                 if (buttonFace != white) {
-                    ConditionalFillRect(hdcSrc, rcPaint, white, buttonFace, colorIndex, /*useFloodFill*/true);
+                    ConditionalFillRect(hdcSrc, rcPaint, white, buttonFace, /*useFloodFill*/true);
 
                     //Wh_Log(L"ConditionalFillRect called");
                 }
@@ -314,5 +717,9 @@ void Wh_ModUninit() {
     } while (g_hookRefCount > 0);
 
 
+    FlushFrameCache();
+    FlushScratchBitmapPool();
+
+
     Wh_Log(L"Uninit complete");
 }